@@ -1,35 +1,31 @@
 #!/usr/bin/env python
 
 from subprocess import *
+import argparse
+import json
 import os
 import sys
-import time
-import csv
 
-def bench(benchPath):
+# Slowdown relative to the baseline beyond which a benchmark is flagged
+REGRESSION_THRESHOLD = 0.05
 
-    startTime = time.time()
+def bench(benchPath, iters, warmup):
 
-    benchCmd = './zeta %s' % benchPath
+    # The benchmark is timed inside the VM, which prints
+    # its results as JSON on the last line of the output
+    benchCmd = './zeta --bench --iters=%d --warmup=%d %s' % (iters, warmup, benchPath)
     pipe = Popen(benchCmd, shell=True, stdout=PIPE, stderr=PIPE)
-
-    # Wait until the benchmark terminates
-    pipe.wait()
-
-    endTime = time.time()
+    output = pipe.communicate()[0].decode('utf-8')
 
     # Verify the return code
     ret = pipe.returncode
     if ret != 0:
-        output = pipe.stdout.read()
         sys.stdout.write('\n')
         sys.stdout.write(output)
         raise Exception('invalid return code: ' + str(ret))
 
-    # Compute the time in milliseconds
-    deltaTime = 1000 * (endTime - startTime)
-
-    return deltaTime
+    lines = output.strip().split('\n')
+    return json.loads(lines[-1])
 
 # Computes the geometric mean of a list of values
 def geoMean(numList):
@@ -43,7 +39,7 @@ def geoMean(numList):
 
     return prod ** (1.0/len(numList))
 
-def runBenchs():
+def runBenchs(args):
 
     benchList = [
         'benchmarks/loop_cnt_100m.zim',
@@ -64,25 +60,64 @@ def runBenchs():
         'benchmarks/zsdf.pls -- 512',
     ]
 
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    results = {}
     timeVals = []
+    regressions = []
 
     for benchPath in benchList:
 
         sys.stdout.write(benchPath.ljust(40))
         sys.stdout.flush()
 
-        timeMs = bench(benchPath)
+        result = bench(benchPath, args.iters, args.warmup)
+        results[benchPath] = result
+
+        # The minimum time is the least affected by noise
+        timeMs = result['min_ms']
         timeVals += [timeMs]
 
-        sys.stdout.write('%6d ms\n' % timeMs)
+        sys.stdout.write('%8.1f ms  (median %.1f, p95 %.1f)' % (
+            timeMs,
+            result['median_ms'],
+            result['p95_ms']
+        ))
+
+        if benchPath in baseline:
+            baseMs = baseline[benchPath]['min_ms']
+            change = (timeMs - baseMs) / baseMs
+            sys.stdout.write('  %+6.1f%%' % (100 * change))
+            if change > REGRESSION_THRESHOLD:
+                sys.stdout.write('  REGRESSION')
+                regressions += [benchPath]
+
+        sys.stdout.write('\n')
 
     meanTime = geoMean(timeVals)
     sys.stdout.write(49 * '-' + '\n')
     sys.stdout.write('geometric mean'.ljust(40))
-    sys.stdout.write('%6d ms\n' % meanTime)
+    sys.stdout.write('%8.1f ms\n' % meanTime)
+
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if regressions:
+        sys.stdout.write('%d regression(s) against %s\n' % (len(regressions), args.baseline))
+        sys.exit(1)
 
 # TODO: trigger make clean, make -j4 to make sure we have a fresh build
 # Note: could ./configure with NDEBUG to disable assertions
 
+parser = argparse.ArgumentParser(description='Run the ZetaVM benchmarks')
+parser.add_argument('--iters', type=int, default=5, help='number of timed runs of each benchmark')
+parser.add_argument('--warmup', type=int, default=1, help='number of untimed warmup runs of each benchmark')
+parser.add_argument('--save', help='file to save the results to, as JSON')
+parser.add_argument('--baseline', help='results file to compare against, to flag regressions')
+
 # Run the benchmarks
-runBenchs()
+runBenchs(parser.parse_args())
@@ -29,9 +29,56 @@ set -x
 # temporaries are left on the stack when returning
 ./zeta tests/vm/regress_ret_stack.zim | grep -q "stack"
 
+# Check that the code of unreachable functions gets collected
+# when the code heap reaches its maximum size
+./zeta --code-heap-init=16 --code-heap-max=64 tests/vm/code_gc.zim
+
+# Check that the stack grows on demand, and that stack
+# overflows can be caught as exceptions
+./zeta --stack-init=64 tests/vm/deep_stack.zim
+
+# The stack overflow must be caught wherever the limit falls,
+# whether it is reached by a call or by pushing temporaries
+for stack_max in 128 256 384 448 512 1024 4096; do
+    ./zeta --stack-max=$stack_max tests/vm/deep_stack.zim | grep -q "caught stack overflow"
+done
+
+# Check that instruction pair profiling reports the pairs executed
+./zeta --dump-op-pairs tests/vm/superinstrs.zim | grep -q "get_local, get_elem"
+
+# Check that the sampling profiler attributes samples to functions
+# and writes collapsed call stacks
+# Note: the output is not piped into grep -q, which could exit before
+# the profile is written and kill the VM with SIGPIPE
+./zeta --profile --profile-out=profile_test.folded benchmarks/fib.pls -- 29 > profile_test.txt
+grep -q "function@benchmarks/fib.pls@3:11" profile_test.txt
+grep -q "fib.pls@11:16;function@benchmarks/fib.pls@3:11" profile_test.folded
+rm profile_test.txt profile_test.folded
+
+# Check that the allocation profiler attributes allocations to sites,
+# recording every allocation or sampling them
+./zeta --alloc-profile tests/plush/alloc_profile.pls > alloc_test.txt
+grep -q "10000  object   function@tests/plush/alloc_profile.pls@5:18" alloc_test.txt
+./zeta --alloc-profile --alloc-sample=16384 tests/plush/alloc_profile.pls > alloc_test.txt
+grep -q "object   function@tests/plush/alloc_profile.pls@5:18" alloc_test.txt
+rm alloc_test.txt
+
+# Check that benchmark mode times repeated calls and reports JSON
+./zeta --bench --iters=3 --warmup=1 benchmarks/fib.pls -- 15 | tail -n 1 | grep -q '"iters": 3, "times_ms": \['
+./zeta --bench --iters=2 tests/vm/ex_loop_cnt.zim | grep -q '"p95_ms"'
+
+# Check that the runtime microbenchmarks run to completion
+./zeta-microbench > /dev/null
+
 # Test that the help option is recognized
 ./zeta --help | grep -q "Usage"
 
+# Baseline JIT tests (ignored on unsupported platforms)
+./zeta --jit tests/plush/fib.pls
+./zeta --jit tests/vm/superinstrs.zim
+./zeta --jit tests/plush/for_loop_sum.pls
+./zeta --jit benchmarks/fib.pls -- 25
+
 ##############################################################################
 # cplush tests (C++ plush compiler implementation)
 ##############################################################################
@@ -83,6 +130,8 @@ set -x
 ./zeta tests/plush/throw_exc2.pls
 ./zeta tests/plush/catch_import_missing.pls
 ./zeta tests/plush/cmdline_args.pls -- foo bar
+./zeta tests/plush/call_cache.pls
+./zeta --exec-stats tests/plush/exec_stats.pls | grep -q "field caches"
 
 # Regression tests
 ./zeta tests/plush/regress_cr_char.pls
@@ -105,6 +154,23 @@ set -x
 # Image parsing and serialization tests
 ./zeta tests/plush/serialize.pls
 
+# Garbage collector tests
+./zeta tests/gc/collect.pls
+./zeta tests/gc/objects.pls
+./zeta tests/gc/objext.pls
+./zeta tests/gc/arrays.pls
+./zeta tests/gc/ret.pls
+./zeta --gc-min=256 tests/gc/strings.pls
+./zeta --gc-min=256 tests/gc/ropes.pls
+./zeta --gc-min=256 tests/plush/self_parse.pls
+./zeta --gen-gc --gc-nursery=64 tests/gc/objects.pls
+./zeta --gen-gc --gc-nursery=64 tests/gc/arrays.pls
+./zeta --gen-gc --gc-nursery=64 --gc-min=256 tests/gc/strings.pls
+./zeta --gen-gc --gc-nursery=64 --gc-min=256 tests/gc/ropes.pls
+./zeta --gen-gc --gc-nursery=64 --gc-min=256 tests/plush/self_parse.pls
+./zeta --gc-threads=4 tests/gc/parallel.pls
+./zeta --gen-gc --gc-threads=4 tests/gc/parallel.pls
+
 ##############################################################################
 # Packages included with ZetaVM
 ##############################################################################
@@ -1,110 +1,164 @@
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <tuple>
+#include <signal.h>
+#include <sys/time.h>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "packages.h"
+#include "jit.h"
 #include <math.h>
 
+/// List of the opcodes, expanded with a macro applied to each name,
+/// so that the opcode enumeration and the opcode names stay in sync
+#define OPCODE_LIST(X)                                       \
+    /* Local variable access */                              \
+    X(GET_LOCAL)                                             \
+    X(SET_LOCAL)                                             \
+                                                             \
+    /* Stack manipulation */                                 \
+    X(PUSH)                                                  \
+    X(POP)                                                   \
+    X(DUP)                                                   \
+    X(SWAP)                                                  \
+                                                             \
+    /* 32-bit integer operations */                          \
+    X(ADD_I32)                                               \
+    X(SUB_I32)                                               \
+    X(MUL_I32)                                               \
+    X(DIV_I32)                                               \
+    X(MOD_I32)                                               \
+    X(SHL_I32)                                               \
+    X(SHR_I32)                                               \
+    X(USHR_I32)                                              \
+    X(AND_I32)                                               \
+    X(OR_I32)                                                \
+    X(XOR_I32)                                               \
+    X(NOT_I32)                                               \
+    X(LT_I32)                                                \
+    X(LE_I32)                                                \
+    X(GT_I32)                                                \
+    X(GE_I32)                                                \
+    X(EQ_I32)                                                \
+    X(INC_I32)                                               \
+    X(DEC_I32)                                               \
+    X(ADD_LOCALS_I32)                                        \
+                                                             \
+    /* Floating-point operations */                          \
+    X(ADD_F32)                                               \
+    X(SUB_F32)                                               \
+    X(MUL_F32)                                               \
+    X(DIV_F32)                                               \
+    X(LT_F32)                                                \
+    X(LE_F32)                                                \
+    X(GT_F32)                                                \
+    X(GE_F32)                                                \
+    X(EQ_F32)                                                \
+    X(SIN_F32)                                               \
+    X(COS_F32)                                               \
+    X(SQRT_F32)                                              \
+    X(LOG_F32)                                               \
+    X(EXP_F32)                                               \
+                                                             \
+    /* Conversion operations */                              \
+    X(I32_TO_F32)                                            \
+    X(I32_TO_STR)                                            \
+    X(F32_TO_I32)                                            \
+    X(F32_TO_STR)                                            \
+    X(STR_TO_F32)                                            \
+                                                             \
+    /* Miscellaneous */                                      \
+    X(EQ_BOOL)                                               \
+    X(HAS_TAG)                                               \
+    X(GET_TAG)                                               \
+    X(LOCAL_HAS_TAG)                                         \
+                                                             \
+    /* String operations */                                  \
+    X(STR_LEN)                                               \
+    X(GET_CHAR)                                              \
+    X(GET_CHAR_CODE)                                         \
+    X(CHAR_TO_STR)                                           \
+    X(STR_CAT)                                               \
+    X(EQ_STR)                                                \
+                                                             \
+    /* Object operations */                                  \
+    X(NEW_OBJECT)                                            \
+    X(HAS_FIELD)                                             \
+    X(HAS_FIELD_IMM)                                         \
+    X(SET_FIELD)                                             \
+    X(SET_FIELD_IMM)                                         \
+    X(GET_FIELD)                                             \
+    X(GET_FIELD_IMM)                                         \
+    X(GET_FIELD_LIST)                                        \
+    X(EQ_OBJ)                                                \
+                                                             \
+    /* Array operations */                                   \
+    X(NEW_ARRAY)                                             \
+    X(ARRAY_LEN)                                             \
+    X(ARRAY_PUSH)                                            \
+    X(ARRAY_POP)                                             \
+    X(GET_ELEM)                                              \
+    X(GET_ELEM_LOCAL)                                        \
+    X(SET_ELEM)                                              \
+    X(EQ_ARRAY)                                              \
+                                                             \
+    /* Branch instructions */                                \
+    X(JUMP)                                                  \
+    X(JUMP_STUB)                                             \
+    X(IF_TRUE)                                               \
+    X(IF_LT_I32)                                             \
+    X(IF_LE_I32)                                             \
+    X(IF_GT_I32)                                             \
+    X(IF_GE_I32)                                             \
+    X(IF_EQ_I32)                                             \
+    X(CALL)                                                  \
+    X(RET)                                                   \
+    X(THROW)                                                 \
+                                                             \
+    /* Entry points for the baseline JIT */                  \
+    X(COUNT_ENTRY)                                           \
+    X(NATIVE_ENTRY)                                          \
+                                                             \
+    /* Block entry counter for instruction pair profiling */ \
+    X(PROFILE_ENTRY)                                         \
+                                                             \
+    /* Block entry check for pending profiler samples */     \
+    X(PROFILE_SAMPLE)
+
 /// Opcode enumeration
 enum Opcode : uint16_t
 {
-    // Local variable access
-    GET_LOCAL,
-    SET_LOCAL,
-
-    // Stack manipulation
-    PUSH,
-    POP,
-    DUP,
-    SWAP,
-
-    // 32-bit integer operations
-    ADD_I32,
-    SUB_I32,
-    MUL_I32,
-    DIV_I32,
-    MOD_I32,
-    SHL_I32,
-    SHR_I32,
-    USHR_I32,
-    AND_I32,
-    OR_I32,
-    XOR_I32,
-    NOT_I32,
-    LT_I32,
-    LE_I32,
-    GT_I32,
-    GE_I32,
-    EQ_I32,
-    INC_I32,
-    DEC_I32,
-
-    // Floating-point operations
-    ADD_F32,
-    SUB_F32,
-    MUL_F32,
-    DIV_F32,
-    LT_F32,
-    LE_F32,
-    GT_F32,
-    GE_F32,
-    EQ_F32,
-    SIN_F32,
-    COS_F32,
-    SQRT_F32,
-    LOG_F32,
-    EXP_F32,
-
-    // Conversion operations
-    I32_TO_F32,
-    I32_TO_STR,
-    F32_TO_I32,
-    F32_TO_STR,
-    STR_TO_F32,
-
-    // Miscellaneous
-    EQ_BOOL,
-    HAS_TAG,
-    GET_TAG,
-    LOCAL_HAS_TAG,
-
-    // String operations
-    STR_LEN,
-    GET_CHAR,
-    GET_CHAR_CODE,
-    CHAR_TO_STR,
-    STR_CAT,
-    EQ_STR,
-
-    // Object operations
-    NEW_OBJECT,
-    HAS_FIELD,
-    SET_FIELD,
-    GET_FIELD,
-    GET_FIELD_IMM,
-    GET_FIELD_LIST,
-    EQ_OBJ,
-
-    // Array operations
-    NEW_ARRAY,
-    ARRAY_LEN,
-    ARRAY_PUSH,
-    ARRAY_POP,
-    GET_ELEM,
-    SET_ELEM,
-    EQ_ARRAY,
-
-    // Branch instructions
-    JUMP,
-    JUMP_STUB,
-    IF_TRUE,
-    CALL,
-    RET,
-    THROW
+    #define OPCODE_ENUM(name) name,
+    OPCODE_LIST(OPCODE_ENUM)
+    #undef OPCODE_ENUM
+
+    // Number of opcodes, must remain last
+    NUM_OPCODES
 };
 
+/// Direct-threaded dispatch stores handler label addresses in the
+/// code heap instead of opcode numbers. This relies on the GCC/clang
+/// labels-as-values extension, and can be disabled at build time.
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/// Opcode representation in the code heap
+#ifdef THREADED_DISPATCH
+typedef const void* OpVal;
+#else
+typedef Opcode OpVal;
+#endif
+
 class CodeFragment
 {
 public:
@@ -124,6 +178,127 @@ public:
     }
 };
 
+/// Tag value for values whose type is not known at compilation time
+const Tag TAG_UNKNOWN = 0xFF;
+
+/// Maximum number of versions generated per block and function.
+/// Once this limit is reached, a generic version is used instead.
+const size_t MAX_VERSIONS = 6;
+
+/**
+Code generation context. Tracks the type tags known at compilation
+time for the values on the temporary stack and in local variables.
+*/
+class CodeGenCtx
+{
+private:
+
+    /// Known tags of the temporaries, stack top last
+    std::vector<Tag> tmpTags;
+
+    /// Known tags of the local variables
+    std::vector<Tag> localTags;
+
+public:
+
+    CodeGenCtx(size_t numLocals, size_t numTmps)
+    : tmpTags(numTmps, TAG_UNKNOWN),
+      localTags(numLocals, TAG_UNKNOWN)
+    {
+    }
+
+    /// Get the size of the temp stack
+    uint16_t numTmps() const
+    {
+        return tmpTags.size();
+    }
+
+    /// Push a value with a given tag on the temp stack
+    void push(Tag tag)
+    {
+        tmpTags.push_back(tag);
+    }
+
+    /// Pop a value off the temp stack, returning its tag
+    Tag pop()
+    {
+        if (tmpTags.empty())
+        {
+            throw RunError(
+                "temporary stack underflow in basic block"
+            );
+        }
+
+        auto tag = tmpTags.back();
+        tmpTags.pop_back();
+        return tag;
+    }
+
+    /// Pop multiple values off the temp stack
+    void pop(size_t numVals)
+    {
+        for (size_t i = 0; i < numVals; ++i)
+            pop();
+    }
+
+    /// Get the tag of a temporary, indexed from the stack top
+    Tag getTmp(size_t idx) const
+    {
+        if (idx >= tmpTags.size())
+            return TAG_UNKNOWN;
+        return tmpTags[tmpTags.size() - 1 - idx];
+    }
+
+    /// Set the tag of a temporary, indexed from the stack top
+    void setTmp(size_t idx, Tag tag)
+    {
+        assert (idx < tmpTags.size());
+        tmpTags[tmpTags.size() - 1 - idx] = tag;
+    }
+
+    /// Get the tag of a local variable
+    Tag getLocal(size_t idx) const
+    {
+        if (idx >= localTags.size())
+            return TAG_UNKNOWN;
+        return localTags[idx];
+    }
+
+    /// Set the tag of a local variable
+    void setLocal(size_t idx, Tag tag)
+    {
+        if (idx >= localTags.size())
+            localTags.resize(idx + 1, TAG_UNKNOWN);
+        localTags[idx] = tag;
+    }
+
+    /// Produce a context of the same shape where no tags are known
+    CodeGenCtx generic() const
+    {
+        return CodeGenCtx(localTags.size(), tmpTags.size());
+    }
+
+    /// Test if no tags are known in this context
+    bool isGeneric() const
+    {
+        for (auto tag : tmpTags)
+            if (tag != TAG_UNKNOWN)
+                return false;
+        for (auto tag : localTags)
+            if (tag != TAG_UNKNOWN)
+                return false;
+        return true;
+    }
+
+    bool operator == (const CodeGenCtx& that) const
+    {
+        return tmpTags == that.tmpTags && localTags == that.localTags;
+    }
+};
+
+struct CodeSegment;
+struct CallInfo;
+
 class BlockVersion : public CodeFragment
 {
 public:
@@ -138,77 +313,207 @@ public:
     uint16_t numTmps;
 
     /// Code generation context at block entry
-    //CodeGenCtx ctx;
+    CodeGenCtx ctx;
+
+    /// Code heap segment this version was compiled into
+    CodeSegment* segment = nullptr;
+
+    /// Call instructions in the compiled code. Their inline caches
+    /// must be cleared when the cached callee's code is collected.
+    std::vector<CallInfo*> callSites;
+
+    /// For call continuations, info of the call instruction returning
+    /// to this version. Null for versions which are not return addresses.
+    CallInfo* retCallInfo = nullptr;
 
-    BlockVersion(Object fun, Object block, uint16_t numTmps)
+    /// Number of times this version was entered, when profiling
+    /// instruction pairs
+    uint64_t entryCount = 0;
+
+    /// Name of the function and source position in profiles,
+    /// once computed
+    const std::string* profName = nullptr;
+    const std::string* profPos = nullptr;
+
+    BlockVersion(Object fun, Object block, const CodeGenCtx& ctx)
     : fun(fun),
       block(block),
-      numTmps(numTmps)
+      numTmps(ctx.numTmps()),
+      ctx(ctx)
     {
     }
 };
 
-/// Struct to associate information with a return address
-struct RetEntry
+/// Entry version and frame layout of a function, cached by call sites
+struct FunEntry
 {
-    /// Associated call instruction
-    refptr callInstr;
+    // Function object
+    refptr fun = nullptr;
 
-    /// Return block version
-    BlockVersion* retVer;
+    // Entry version for the function
+    BlockVersion* entryVer = nullptr;
 
-    /// Exception/catch block version (may be null)
-    BlockVersion* excVer = nullptr;
+    // Number of locals for the function
+    uint16_t numLocals = 0;
 
-    /// Temporary stack size before the call instruction
-    uint16_t numTmps;
+    // Number of parameters of the function
+    uint16_t numParams = 0;
 };
 
+/// Number of entries in the polymorphic inline cache of call sites
+const size_t CALL_CACHE_SIZE = 4;
+
 /// Information stored by call instructions
 struct CallInfo
 {
     // Block version to return to after the call
     BlockVersion* retVer;
 
-    // Last seen (cached) function
-    refptr lastFn = nullptr;
+    // Exception/catch block version (may be null)
+    BlockVersion* excVer = nullptr;
 
-    // Entry version for the cached function
-    BlockVersion* entryVer = nullptr;
+    // Temporary stack size before the call instruction
+    // Note: this excludes the arguments and the function object
+    uint16_t numTmps;
 
-    // Number of locals for the cached function
-    uint16_t numLocals = 0;
+    // Cached functions, in the order they were first seen
+    FunEntry cache[CALL_CACHE_SIZE];
 
     // Number of call site arguments
     uint16_t numArgs;
+
+    // Number of valid cache entries
+    uint16_t numEntries = 0;
+};
+
+/// Information stored by block entry counters, when the JIT is enabled
+struct EntryCounter
+{
+    // Native code for the block, once compiled
+    NativeFn nativeFn = nullptr;
+
+    // Number of times the block was entered
+    uint32_t count = 0;
+};
+
+/**
+Segment of the code heap. Code is allocated in a segment until it is
+full, at which point a new segment is chained. Blocks never straddle
+segments, since all branches to other blocks go through jumps.
+*/
+struct CodeSegment
+{
+    /// Start and limit pointers of the segment memory
+    uint8_t* start;
+    uint8_t* limit;
+
+    /// Allocation pointer, updated when the segment stops being current
+    uint8_t* alloc;
+
+    /// Block versions compiled into this segment which have not
+    /// been collected yet, sorted by start address
+    std::vector<BlockVersion*> versions;
 };
 
 typedef std::vector<BlockVersion*> VersionList;
 
-/// Initial code heap size in bytes
-const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
+/// Upper bound on the code size generated for one block instruction.
+/// This is used to reserve space for a block before compiling it.
+const size_t MAX_INSTR_SIZE = 192;
+static_assert(
+    2 * sizeof(OpVal) + sizeof(Word) + sizeof(Tag) + sizeof(CallInfo) <= MAX_INSTR_SIZE,
+    "the import instruction must fit within MAX_INSTR_SIZE"
+);
+
+/// Initial code heap size, and size of new segments, in bytes
+size_t codeHeapInitSize = 1 << 20;
+
+/// Maximum total code heap size in bytes
+size_t codeHeapMaxSize = 1 << 30;
+
+/// Initial stack size in bytes
+size_t stackInitSize = (1 << 16) * sizeof(Value);
+
+/// Maximum stack size in bytes, beyond which a stack overflow is reported
+size_t stackMaxSize = (1 << 24) * sizeof(Value);
+
+/// Size of the executable memory region for native code
+const size_t JIT_REGION_SIZE = 1 << 24;
+
+/// Number of entries after which a block version is compiled natively
+const uint32_t JIT_THRESHOLD = 500;
+
+/// Enable the baseline JIT compiler
+bool jitEnabled = false;
+
+/// Enable the profiling of executed block instruction pairs
+bool opPairsEnabled = false;
+
+/// Enable the sampling profiler
+bool profileEnabled = false;
+
+/// Enable the counting of executed instructions
+bool execStatsEnabled = false;
+
+/// Enable the allocation profiler, and number of bytes
+/// allocated between samples, zero to record every allocation
+bool allocProfEnabled = false;
+size_t allocSampleBytes = 0;
 
-/// Initial stack size in words
-const size_t STACK_INIT_SIZE = 1 << 16;
+/// File the sampling profiler writes collapsed call stacks to
+std::string profileOutFile = "zeta.folded";
 
-/// Flat array of bytes into which code gets compiled
-uint8_t* codeHeap = nullptr;
+/// Segments making up the code heap, in allocation order
+std::vector<CodeSegment*> codeSegments;
 
-/// Limit pointer for the code heap
+/// Segment into which code currently gets compiled
+CodeSegment* curSegment = nullptr;
+
+/// Limit pointer for the current code heap segment
 uint8_t* codeHeapLimit = nullptr;
 
-/// Current allocation pointer in the code heap
+/// Current allocation pointer in the current code heap segment
 uint8_t* codeHeapAlloc = nullptr;
 
+/// Total memory size of the code heap segments, in bytes
+size_t codeHeapReserved = 0;
+
+/// Number of code collections performed
+size_t codeCollectCount = 0;
+
 /// Map of block objects to lists of versions
 std::unordered_map<refptr, VersionList> versionMap;
 
-/// Map of instructions to block versions
-/// Note: this isn't defined for all instructions
-std::unordered_map<uint8_t*, BlockVersion*> instrMap;
+/// Functions and blocks of the versions created since the last
+/// garbage collection, which minor collections use as roots
+ValueVec youngVersionRoots;
+
+
+/// Map of functions to entry information, used by megamorphic call sites
+std::unordered_map<refptr, FunEntry> funEntryMap;
+
+/// Number of block versions compiled, and time spent compiling them
+uint64_t compileCount = 0;
+uint64_t compileTimeNs = 0;
+
+/// Call site inline cache statistics
+uint64_t callCacheHits = 0;
+uint64_t callCacheMisses = 0;
+uint64_t callMegaLookups = 0;
+
+/// Number of jump stubs and conditional branch targets patched
+uint64_t jumpPatchCount = 0;
+uint64_t branchPatchCount = 0;
 
-/// Map of return addresses to associated info
-std::unordered_map<BlockVersion*, RetEntry> retAddrMap;
+/// Execution counts of the opcodes, when counting instructions
+uint64_t opCounts[NUM_OPCODES];
+
+/// Opcode names, indexed by opcode
+const char* opNames[NUM_OPCODES] = {
+    #define OPCODE_NAME(name) #name,
+    OPCODE_LIST(OPCODE_NAME)
+    #undef OPCODE_NAME
+};
 
 /// Lower stack limit (stack pointer must be greater than this)
 Value* stackLimit = nullptr;
@@ -238,6 +543,27 @@ template <typename T> void writeCode(T val)
     assert (codeHeapAlloc <= codeHeapLimit);
 }
 
+/// Table of instruction handler addresses, indexed by opcode
+/// Note: this is filled in by execCode() in initInterp()
+const void** opHandlers = nullptr;
+
+/// Get the code heap representation of an opcode
+inline OpVal encodeOp(Opcode op)
+{
+#ifdef THREADED_DISPATCH
+    assert (opHandlers);
+    return opHandlers[op];
+#else
+    return op;
+#endif
+}
+
+/// Write an opcode to the code heap
+void writeCode(Opcode op)
+{
+    writeCode<OpVal>(encodeOp(op));
+}
+
 /// Deny writing Value objects in the code heap,
 /// because they are managed by the garbage collector
 void writeCode(Value val)
@@ -248,16 +574,80 @@ void writeCode(Value val)
 /// Return a pointer to a value to read from the code stream
 template <typename T> __attribute__((always_inline)) inline T& readCode()
 {
-    assert (instrPtr + sizeof(T) <= codeHeapLimit);
+    assert (instrPtr != nullptr);
     T* valPtr = (T*)instrPtr;
     instrPtr += sizeof(T);
     return *valPtr;
 }
 
+/**
+Exception thrown when the stack would exceed its maximum size
+*/
+class StackOverflow : public RunError
+{
+public:
+
+    StackOverflow() : RunError("stack overflow") {}
+    ~StackOverflow() {}
+};
+
+/**
+Grow the stack so that at least a given number of values can be pushed.
+The stack contents are moved into a larger array, and the stack and frame
+pointers saved in stack frames are relocated. Throws a StackOverflow if
+the stack would exceed its maximum size.
+*/
+__attribute__((noinline)) void growStack(size_t numVals)
+{
+    size_t usedSize = stackBase - stackPtr;
+    size_t oldSize = stackBase - stackLimit;
+    size_t maxSize = stackMaxSize / sizeof(Value);
+
+    if (usedSize + numVals > maxSize)
+    {
+        throw StackOverflow();
+    }
+
+    auto newSize = std::min(std::max(2 * oldSize, usedSize + numVals), maxSize);
+    auto newLimit = new Value[newSize];
+    auto newBase = newLimit + newSize;
+
+    // Copy the values to the top of the new stack
+    auto newStackPtr = newBase - usedSize;
+    std::copy(stackPtr, stackBase, newStackPtr);
+
+    // Relocate the pointers into the stack
+    auto relocate = [&](Value* ptr)
+    {
+        assert (ptr >= stackLimit && ptr <= stackBase);
+        return newBase - (stackBase - ptr);
+    };
+
+    for (auto ptr = newStackPtr; ptr < newBase; ++ptr)
+    {
+        if (ptr->getTag() != TAG_RAWPTR)
+            continue;
+
+        auto rawPtr = (Value*)ptr->getWord().ptr;
+        if (rawPtr >= stackLimit && rawPtr <= stackBase)
+            *ptr = Value((refptr)relocate(rawPtr), TAG_RAWPTR);
+    }
+
+    if (framePtr >= stackLimit && framePtr <= stackBase)
+        framePtr = relocate(framePtr);
+
+    delete [] stackLimit;
+
+    stackPtr = newStackPtr;
+    stackLimit = newLimit;
+    stackBase = newBase;
+}
+
 /// Push a value on the stack
 __attribute__((always_inline)) inline void pushVal(Value val)
 {
-    assert (stackPtr > stackLimit && "stack overflow");
+    if (__builtin_expect(stackPtr <= stackLimit, 0))
+        growStack(1);
     stackPtr--;
     stackPtr[0] = val;
 }
@@ -316,9 +706,37 @@ __attribute__((always_inline)) inline Object popObj()
     return (Object)val;
 }
 
+/// Compute the amount of code allocated in the code heap, in bytes
 size_t codeHeapSize()
 {
-    return codeHeapAlloc - codeHeap;
+    size_t size = 0;
+
+    for (auto segment : codeSegments)
+    {
+        auto alloc = (segment == curSegment)? codeHeapAlloc:segment->alloc;
+        size += alloc - segment->start;
+    }
+
+    return size;
+}
+
+/// Allocate a new code heap segment and make it the current segment
+void newCodeSegment(size_t size)
+{
+    if (curSegment)
+        curSegment->alloc = codeHeapAlloc;
+
+    auto segment = new CodeSegment();
+    segment->start = new uint8_t[size];
+    segment->limit = segment->start + size;
+    segment->alloc = segment->start;
+
+    codeSegments.push_back(segment);
+    codeHeapReserved += size;
+
+    curSegment = segment;
+    codeHeapLimit = segment->limit;
+    codeHeapAlloc = segment->alloc;
 }
 
 /// Compute the stack size (number of slots allocated)
@@ -333,154 +751,1053 @@ __attribute__((always_inline)) inline size_t frameSize()
     return framePtr - stackPtr + 1;
 }
 
-/// Initialize the interpreter
-void initInterp()
+/// Opcodes of the instructions found in basic block objects
+enum BlockOp : uint8_t
 {
-    // Allocate the code heap
-    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
-    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
-    codeHeapAlloc = codeHeap;
+    OP_PUSH,
+    OP_POP,
+    OP_DUP,
+    OP_SWAP,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_ADD_I32,
+    OP_SUB_I32,
+    OP_MUL_I32,
+    OP_DIV_I32,
+    OP_MOD_I32,
+    OP_SHL_I32,
+    OP_SHR_I32,
+    OP_USHR_I32,
+    OP_AND_I32,
+    OP_OR_I32,
+    OP_XOR_I32,
+    OP_NOT_I32,
+    OP_LT_I32,
+    OP_LE_I32,
+    OP_GT_I32,
+    OP_GE_I32,
+    OP_EQ_I32,
+    OP_ADD_F32,
+    OP_SUB_F32,
+    OP_MUL_F32,
+    OP_DIV_F32,
+    OP_LT_F32,
+    OP_LE_F32,
+    OP_GT_F32,
+    OP_GE_F32,
+    OP_EQ_F32,
+    OP_SIN_F32,
+    OP_COS_F32,
+    OP_SQRT_F32,
+    OP_LOG_F32,
+    OP_EXP_F32,
+    OP_I32_TO_F32,
+    OP_I32_TO_STR,
+    OP_F32_TO_I32,
+    OP_F32_TO_STR,
+    OP_STR_TO_F32,
+    OP_EQ_BOOL,
+    OP_HAS_TAG,
+    OP_GET_TAG,
+    OP_STR_LEN,
+    OP_GET_CHAR,
+    OP_GET_CHAR_CODE,
+    OP_CHAR_TO_STR,
+    OP_STR_CAT,
+    OP_EQ_STR,
+    OP_NEW_OBJECT,
+    OP_HAS_FIELD,
+    OP_SET_FIELD,
+    OP_GET_FIELD,
+    OP_GET_FIELD_LIST,
+    OP_EQ_OBJ,
+    OP_NEW_ARRAY,
+    OP_ARRAY_LEN,
+    OP_ARRAY_PUSH,
+    OP_ARRAY_POP,
+    OP_SET_ELEM,
+    OP_GET_ELEM,
+    OP_EQ_ARRAY,
+    OP_JUMP,
+    OP_IF_TRUE,
+    OP_CALL,
+    OP_RET,
+    OP_THROW,
+    OP_IMPORT,
+
+    // No instruction (end of block) or unknown opcode name
+    OP_NONE
+};
 
-    // Allocate the stack
-    stackLimit = new Value[STACK_INIT_SIZE];
-    stackBase = stackLimit + STACK_INIT_SIZE;
-    stackPtr = stackBase;
-}
+/// Opcode names, indexed by BlockOp
+const char* blockOpNames[OP_NONE] =
+{
+    "push",
+    "pop",
+    "dup",
+    "swap",
+    "get_local",
+    "set_local",
+    "add_i32",
+    "sub_i32",
+    "mul_i32",
+    "div_i32",
+    "mod_i32",
+    "shl_i32",
+    "shr_i32",
+    "ushr_i32",
+    "and_i32",
+    "or_i32",
+    "xor_i32",
+    "not_i32",
+    "lt_i32",
+    "le_i32",
+    "gt_i32",
+    "ge_i32",
+    "eq_i32",
+    "add_f32",
+    "sub_f32",
+    "mul_f32",
+    "div_f32",
+    "lt_f32",
+    "le_f32",
+    "gt_f32",
+    "ge_f32",
+    "eq_f32",
+    "sin_f32",
+    "cos_f32",
+    "sqrt_f32",
+    "log_f32",
+    "exp_f32",
+    "i32_to_f32",
+    "i32_to_str",
+    "f32_to_i32",
+    "f32_to_str",
+    "str_to_f32",
+    "eq_bool",
+    "has_tag",
+    "get_tag",
+    "str_len",
+    "get_char",
+    "get_char_code",
+    "char_to_str",
+    "str_cat",
+    "eq_str",
+    "new_object",
+    "has_field",
+    "set_field",
+    "get_field",
+    "get_field_list",
+    "eq_obj",
+    "new_array",
+    "array_len",
+    "array_push",
+    "array_pop",
+    "set_elem",
+    "get_elem",
+    "eq_array",
+    "jump",
+    "if_true",
+    "call",
+    "ret",
+    "throw",
+    "import",
+};
 
-/// Get a version of a block. This version will be a stub
-/// until compiled
-BlockVersion* getBlockVersion(
-    Object fun,
-    Object block,
-    uint16_t numTmps,
-    bool forceNew = false
-)
+/// Opcode table entry, holding an interned opcode name string
+struct BlockOpEntry
 {
-    auto blockPtr = (refptr)block;
-    auto versionItr = versionMap.find((refptr)block);
+    refptr name;
+    BlockOp op;
+};
 
-    // If there are no existing versions of this block
-    if (versionItr == versionMap.end())
-    {
-        versionMap[blockPtr] = VersionList();
-    }
-    else if (!forceNew)
-    {
-        auto versions = versionItr->second;
-        assert (versions.size() > 0);
+/// Opcode table, indexed by the low bits of the opcode name hash codes.
+/// The table is sized so that each opcode name has its own entry.
+std::vector<BlockOpEntry> blockOpTable;
+size_t blockOpMask = 0;
 
-        // For each version of this block
-        for (auto version : versions)
-        {
-            if (version->fun != fun)
-            {
-                continue;
-            }
+/// Interned opcode name strings, referenced by the opcode table
+ValueVec blockOpStrs;
 
-            if (version->numTmps != numTmps)
-            {
-                throw RunError(
-                    "a basic block must always receive the same number of "
-                    "values on the temporary stack at its entry"
-                );
-            }
+/// Intern the opcode names and fill the opcode table
+void initBlockOps()
+{
+    for (size_t i = 0; i < OP_NONE; ++i)
+        blockOpStrs.push_back(String(blockOpNames[i]));
 
-            return version;
+    // The table size must be a power of two for masking
+    size_t size = 1;
+    while (size < 2 * OP_NONE)
+        size *= 2;
+
+    // Grow the table until the opcode names do not collide
+    for (;; size *= 2)
+    {
+        blockOpMask = size - 1;
+        blockOpTable.assign(size, { nullptr, OP_NONE });
+
+        size_t numAdded = 0;
+        for (; numAdded < OP_NONE; ++numAdded)
+        {
+            auto opStr = String(blockOpStrs[numAdded]);
+            auto& entry = blockOpTable[opStr.getHash() & blockOpMask];
+            if (entry.name)
+                break;
+            entry = { (refptr)opStr, (BlockOp)numAdded };
         }
+
+        if (numAdded == OP_NONE)
+            break;
     }
+}
 
-    // Create a new version and add it to the list
-    auto& versionList = versionMap[blockPtr];
-    auto newVersion = new BlockVersion(fun, block, numTmps);
-    versionList.push_back(newVersion);
+/// Get the opcode of an instruction object. Opcode names are interned
+/// strings, so a name is decoded by comparing it with the string found
+/// in the opcode table entry for its hash code.
+BlockOp getBlockOp(Object instr)
+{
+    static ICache opIC("op");
+    auto opStr = opIC.getStr(instr);
 
-    return newVersion;
+    auto& entry = blockOpTable[opStr.getHash() & blockOpMask];
+    return (entry.name == (refptr)opStr)? entry.op:OP_NONE;
 }
 
-void genCall(
-    BlockVersion* version,
-    Object callInstr,
-    size_t numArgs,
-    uint16_t& numTmps
-)
+/// Get the opcode of the ith instruction of a block, or
+/// OP_NONE if the end of the block is reached
+BlockOp getOp(Array& instrs, size_t i)
 {
-    // Store a mapping of this instruction to the block version
-    instrMap[codeHeapAlloc] = version;
+    if (i >= instrs.length())
+    {
+        return OP_NONE;
+    }
+    auto instr = (Object)instrs.getElem(i);
+    return getBlockOp(instr);
+}
 
-    // Arguments and the function object are popped off the stack,
-    // a return value or exception is pushed on the stack
-    numTmps -= numArgs;
+/// Execution counts of consecutive block instruction pairs, for
+/// versions whose code was collected
+uint64_t opPairCounts[OP_NONE + 1][OP_NONE + 1];
 
-    // Create a return address entry unique to this call instruction
-    // and this block version
-    RetEntry retEntry;
-    retEntry.callInstr = (refptr)callInstr;
+/// Add the instruction pair counts of a block version to a count table
+void countOpPairs(BlockVersion* version, uint64_t counts[][OP_NONE + 1])
+{
+    if (version->entryCount == 0)
+        return;
 
-    // Store the number of temporaries when the call is performed
-    // Note: this excludes the arguments and the function object
-    assert (numTmps >= 1);
-    retEntry.numTmps = numTmps - 1;
+    static ICache instrsIC("instrs");
+    auto instrs = instrsIC.getArr(version->block);
 
-    // Get a version for the call continuation block
-    // Note: we force the creation of a new version unique to this call site
-    static ICache retToCache("ret_to");
-    auto retToBB = retToCache.getObj(callInstr);
-    auto retVer = getBlockVersion(version->fun, retToBB, numTmps, true);
-    retEntry.retVer = retVer;
+    for (size_t i = 0; i + 1 < instrs.length(); ++i)
+    {
+        auto op0 = getOp(instrs, i);
+        auto op1 = getOp(instrs, i + 1);
+        counts[op0][op1] += version->entryCount;
+    }
+}
 
-    if (callInstr.hasField("throw_to"))
+/// Print the most frequently executed block instruction pairs
+void printOpPairs()
+{
+    static uint64_t counts[OP_NONE + 1][OP_NONE + 1];
+    memcpy(counts, opPairCounts, sizeof(counts));
+
+    for (auto& pair : versionMap)
+        for (auto version : pair.second)
+            countOpPairs(version, counts);
+
+    std::vector<std::pair<uint64_t, std::pair<BlockOp, BlockOp>>> pairs;
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < OP_NONE; ++i)
     {
-        // Get a version for the exception catch block
-        // Note: the catch block expects only one temporary as input
-        static ICache throwIC("throw_to");
-        auto throwBB = throwIC.getObj(callInstr);
-        auto throwVer = getBlockVersion(version->fun, throwBB, 1);
-        retEntry.excVer = throwVer;
+        for (size_t j = 0; j < OP_NONE; ++j)
+        {
+            if (counts[i][j] == 0)
+                continue;
+
+            pairs.push_back({ counts[i][j], { (BlockOp)i, (BlockOp)j } });
+            total += counts[i][j];
+        }
     }
 
-    // Create an entry for the return address
-    retAddrMap[retVer] = retEntry;
+    std::sort(pairs.rbegin(), pairs.rend());
 
-    writeCode(CALL);
+    std::cout << "instruction pair counts (total " << total << ")" << std::endl;
 
-    CallInfo callInfo;
-    callInfo.numArgs = numArgs;
-    callInfo.retVer = retVer;
-    writeCode(callInfo);
+    for (size_t i = 0; i < pairs.size() && i < 25; ++i)
+    {
+        auto& pair = pairs[i];
+        printf(
+            "%12lu %6.2f%%  %s, %s\n",
+            (unsigned long)pair.first,
+            100.0 * pair.first / total,
+            blockOpNames[pair.second.first],
+            blockOpNames[pair.second.second]
+        );
+    }
 }
 
-std::string getOp(Array& instrs, size_t i)
+/// Get the execution counts of the opcodes executed so far
+std::vector<std::pair<std::string, uint64_t>> getOpCounts()
 {
-    if (i >= instrs.length())
+    std::vector<std::pair<std::string, uint64_t>> counts;
+
+    for (size_t i = 0; i < NUM_OPCODES; ++i)
     {
-        //We reached the end of the bb
-        return "nop";
+        if (opCounts[i] == 0)
+            continue;
+
+        std::string name = opNames[i];
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        counts.push_back({ name, opCounts[i] });
     }
-    auto instr = (Object)instrs.getElem(i);
-    static ICache opIC("op");
-    return (std::string)opIC.getStr(instr);
-};
 
-void compile(BlockVersion* version)
+    return counts;
+}
+
+/// Print the execution statistics of the interpreter
+void printExecStats()
 {
-    //std::cout << "compiling version" << std::endl;
+    auto counts = getOpCounts();
+    uint64_t total = 0;
+    for (auto& count : counts)
+        total += count.second;
 
-    auto block = version->block;
+    std::sort(
+        counts.begin(),
+        counts.end(),
+        [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b)
+        { return a.second > b.second; }
+    );
 
-    // Get the instructions array
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
+    std::cout << "instruction counts (total " << total << ")" << std::endl;
 
-    if (instrs.length() == 0)
+    for (auto& count : counts)
     {
-        throw RunError("empty basic block");
+        printf(
+            "%14lu %6.2f%%  %s\n",
+            (unsigned long)count.second,
+            100.0 * count.second / total,
+            count.first.c_str()
+        );
     }
 
-    // Mark the block start
-    version->startPtr = codeHeapAlloc;
+    auto printRate = [](const char* name, uint64_t hits, uint64_t misses)
+    {
+        auto total = hits + misses;
+        printf(
+            "%s: %lu hits, %lu misses (%.2f%% hit rate)\n",
+            name,
+            (unsigned long)hits,
+            (unsigned long)misses,
+            total? (100.0 * hits / total):0.0
+        );
+    };
 
-    // Get the size of the temp stack at the beginning of this version
-    uint16_t numTmps = version->numTmps;
+    printf("block versions compiled: %lu\n", (unsigned long)compileCount);
+    printf("jump stubs patched: %lu\n", (unsigned long)jumpPatchCount);
+    printf("branch targets patched: %lu\n", (unsigned long)branchPatchCount);
+    printRate("field caches", fieldCacheHits, fieldCacheMisses);
+
+    // Calls at megamorphic sites miss the cache and look up the callee
+    printRate("call caches", callCacheHits, callCacheMisses + callMegaLookups);
+    printf("megamorphic call lookups: %lu\n", (unsigned long)callMegaLookups);
+}
+
+Value execCode();
+void startProfiler();
+void recordAlloc(size_t numBytes, Tag tag, size_t sampledBytes);
+
+/// Initialize the interpreter
+void initInterp()
+{
+    if (codeHeapInitSize > codeHeapMaxSize)
+    {
+        throw RunError(
+            "the initial code heap size exceeds the maximum code heap size"
+        );
+    }
+
+    // Allocate the first code heap segment
+    newCodeSegment(codeHeapInitSize);
+
+    // Intern the block instruction opcode names
+    initBlockOps();
+
+    // Allocate the stack
+    auto numVals = std::min(stackInitSize, stackMaxSize) / sizeof(Value);
+    if (numVals == 0)
+    {
+        throw RunError("the stack size must be nonzero");
+    }
+    stackLimit = new Value[numVals];
+    stackBase = stackLimit + numVals;
+    stackPtr = stackBase;
+
+#ifdef THREADED_DISPATCH
+    // Get the instruction handler addresses
+    execCode();
+#endif
+
+    if (jitEnabled)
+    {
+        initJIT(JIT_REGION_SIZE);
+    }
+
+    if (profileEnabled)
+    {
+        startProfiler();
+    }
+
+    if (allocProfEnabled)
+    {
+        vm.setAllocHook(recordAlloc, allocSampleBytes);
+    }
+}
+
+/// Get a version of a block for a given code generation context.
+/// This version will be a stub until compiled
+BlockVersion* getBlockVersion(
+    Object fun,
+    Object block,
+    const CodeGenCtx& ctx,
+    bool forceNew = false
+)
+{
+    auto& versionList = versionMap[(refptr)block];
+
+    if (!forceNew)
+    {
+        // Number of versions of this block for this function
+        size_t numVersions = 0;
+
+        BlockVersion* genericVer = nullptr;
+
+        // For each version of this block
+        for (auto version : versionList)
+        {
+            if (version->fun != fun)
+            {
+                continue;
+            }
+
+            if (version->numTmps != ctx.numTmps())
+            {
+                throw RunError(
+                    "a basic block must always receive the same number of "
+                    "values on the temporary stack at its entry"
+                );
+            }
+
+            if (version->ctx == ctx)
+            {
+                return version;
+            }
+
+            if (version->ctx.isGeneric())
+            {
+                genericVer = version;
+            }
+
+            numVersions++;
+        }
+
+        // If the version limit is reached, fall back to a
+        // generic version which makes no type assumptions
+        if (numVersions + 1 >= MAX_VERSIONS)
+        {
+            if (genericVer)
+                return genericVer;
+
+            auto newVersion = new BlockVersion(fun, block, ctx.generic());
+            versionList.push_back(newVersion);
+            youngVersionRoots.push_back(fun);
+            youngVersionRoots.push_back(block);
+            return newVersion;
+        }
+    }
+
+    // Create a new version and add it to the list
+    auto newVersion = new BlockVersion(fun, block, ctx);
+    versionList.push_back(newVersion);
+    youngVersionRoots.push_back(fun);
+    youngVersionRoots.push_back(block);
+
+    return newVersion;
+}
+
+/**
+Perform a garbage collection of the heap. This must only happen at
+points where every live value is on the interpreter stack or in one
+of the root sets below, and not only held by C++ code.
+*/
+void gcCollect(bool full)
+{
+    auto minor = vm.beginCollect(full);
+
+    // Values on the interpreter stack
+    for (auto valPtr = stackPtr; valPtr < stackBase; ++valPtr)
+        vm.markRoot(*valPtr);
+
+    for (auto& str : charStrings)
+        vm.markRoot(str);
+
+    for (auto& str : blockOpStrs)
+        vm.markRoot(str);
+
+    for (auto& pair : pkgCache)
+        vm.markRoot(pair.second);
+
+    // Functions and blocks with compiled code. The constants embedded
+    // in the code are reachable from the block instructions, and the
+    // functions in call site caches have compiled entry versions.
+    // The versions created before the last collection only refer
+    // to old objects.
+    if (minor)
+    {
+        for (auto& val : youngVersionRoots)
+            vm.markRoot(val);
+    }
+    else
+    {
+        for (auto& pair : versionMap)
+        {
+            for (auto version : pair.second)
+            {
+                vm.markRoot(version->fun);
+                vm.markRoot(version->block);
+            }
+        }
+    }
+
+    youngVersionRoots.clear();
+
+    vm.endCollect();
+}
+
+/// Collect garbage if enough memory was allocated since the last
+/// collection. Must only be called when all live values are rooted.
+__attribute__((always_inline)) inline void gcSafepoint()
+{
+    if (vm.gcNeeded())
+        gcCollect(false);
+}
+
+/**
+Collect the block versions of functions which are no longer reachable,
+and free the code heap segments which no longer contain live code.
+The version passed as argument is about to be compiled, and its
+function is kept alive.
+*/
+void collectCode(BlockVersion* liveVer)
+{
+    codeCollectCount++;
+
+    // The roots are the loaded packages, the values on the stack and
+    // the functions which have frames on the stack or are being compiled
+    ValueVec roots;
+    roots.push_back(liveVer->fun);
+
+    std::unordered_set<BlockVersion*> allVers;
+    for (auto& pair : versionMap)
+        allVers.insert(pair.second.begin(), pair.second.end());
+
+    for (auto& pair : pkgCache)
+        roots.push_back(pair.second);
+
+    for (auto ptr = stackPtr; ptr < stackBase; ++ptr)
+    {
+        if (ptr->getTag() != TAG_RAWPTR)
+        {
+            roots.push_back(*ptr);
+            continue;
+        }
+
+        // Return addresses identify the caller functions
+        auto retVer = (BlockVersion*)ptr->getWord().ptr;
+        if (allVers.count(retVer))
+            roots.push_back(retVer->fun);
+    }
+
+    std::unordered_set<refptr> reachable;
+    findReachable(roots, reachable);
+
+    // Remove the versions of unreachable functions from the version map
+    std::unordered_set<BlockVersion*> deadVers;
+    for (auto itr = versionMap.begin(); itr != versionMap.end();)
+    {
+        auto& versionList = itr->second;
+
+        auto isDead = [&](BlockVersion* version)
+        {
+            if (reachable.count((refptr)version->fun))
+                return false;
+            deadVers.insert(version);
+            return true;
+        };
+
+        versionList.erase(
+            std::remove_if(versionList.begin(), versionList.end(), isDead),
+            versionList.end()
+        );
+
+        if (versionList.empty())
+            itr = versionMap.erase(itr);
+        else
+            ++itr;
+    }
+
+    if (deadVers.empty())
+        return;
+
+    for (auto itr = funEntryMap.begin(); itr != funEntryMap.end();)
+    {
+        if (deadVers.count(itr->second.entryVer))
+            itr = funEntryMap.erase(itr);
+        else
+            ++itr;
+    }
+
+    // Remove the call inline cache entries for collected entry versions
+    for (auto& pair : versionMap)
+    {
+        for (auto version : pair.second)
+        {
+            for (auto callInfo : version->callSites)
+            {
+                size_t numEntries = 0;
+
+                for (size_t i = 0; i < callInfo->numEntries; ++i)
+                {
+                    if (!deadVers.count(callInfo->cache[i].entryVer))
+                        callInfo->cache[numEntries++] = callInfo->cache[i];
+                }
+
+                for (size_t i = numEntries; i < CALL_CACHE_SIZE; ++i)
+                    callInfo->cache[i] = FunEntry();
+
+                callInfo->numEntries = numEntries;
+            }
+        }
+    }
+
+    for (auto segment : codeSegments)
+    {
+        auto& versions = segment->versions;
+        versions.erase(
+            std::remove_if(
+                versions.begin(),
+                versions.end(),
+                [&](BlockVersion* v) { return deadVers.count(v) > 0; }
+            ),
+            versions.end()
+        );
+    }
+
+    for (auto version : deadVers)
+    {
+        // Keep the profiling counts of collected versions
+        if (opPairsEnabled)
+            countOpPairs(version, opPairCounts);
+
+        delete version;
+    }
+
+    // Free the segments left without any live code
+    for (auto itr = codeSegments.begin(); itr != codeSegments.end();)
+    {
+        auto segment = *itr;
+
+        if (segment == curSegment || segment->versions.size() > 0)
+        {
+            ++itr;
+            continue;
+        }
+
+        codeHeapReserved -= segment->limit - segment->start;
+        delete [] segment->start;
+        delete segment;
+        itr = codeSegments.erase(itr);
+    }
+}
+
+/**
+Ensure that a given number of bytes can be written contiguously into
+the current code heap segment, chaining a new segment if needed.
+Unreachable code is collected when the maximum heap size is reached.
+*/
+void reserveCode(size_t numBytes, BlockVersion* version)
+{
+    if (codeHeapAlloc + numBytes <= codeHeapLimit)
+        return;
+
+    auto segSize = std::max(codeHeapInitSize, numBytes);
+
+    if (codeHeapReserved + segSize > codeHeapMaxSize)
+    {
+        collectCode(version);
+
+        if (codeHeapReserved + segSize > codeHeapMaxSize)
+        {
+            throw RunError(
+                "code heap size limit exceeded (" +
+                std::to_string(codeHeapMaxSize) + " bytes)"
+            );
+        }
+    }
+
+    newCodeSegment(segSize);
+}
+
+void genCall(
+    BlockVersion* version,
+    Object callInstr,
+    size_t numArgs,
+    CodeGenCtx& ctx
+)
+{
+    // Arguments and the function object are popped off the stack
+    ctx.pop(numArgs + 1);
+
+    CallInfo callInfo;
+    callInfo.numArgs = numArgs;
+
+    // Store the number of temporaries when the call is performed
+    callInfo.numTmps = ctx.numTmps();
+
+    if (callInstr.hasField("throw_to"))
+    {
+        // Get a version for the exception catch block
+        // Note: the catch block expects only one temporary as input,
+        // the local variables are unchanged by the call
+        auto excCtx = ctx;
+        excCtx.pop(excCtx.numTmps());
+        excCtx.push(TAG_UNKNOWN);
+
+        static ICache throwIC("throw_to");
+        auto throwBB = throwIC.getObj(callInstr);
+        callInfo.excVer = getBlockVersion(version->fun, throwBB, excCtx);
+    }
+
+    // A return value of unknown type is pushed on the stack
+    ctx.push(TAG_UNKNOWN);
+
+    // Get a version for the call continuation block
+    // Note: we force the creation of a new version unique to this call site
+    static ICache retToCache("ret_to");
+    auto retToBB = retToCache.getObj(callInstr);
+    auto retVer = getBlockVersion(version->fun, retToBB, ctx, true);
+    callInfo.retVer = retVer;
+
+    writeCode(CALL);
+
+    // The call info is stored inline after the call instruction. The
+    // return address version points to it, for exception handling.
+    auto callInfoPtr = (CallInfo*)codeHeapAlloc;
+    retVer->retCallInfo = callInfoPtr;
+
+    // Remember the call site, so its inline cache can be cleared
+    version->callSites.push_back(callInfoPtr);
+
+    writeCode(callInfo);
+}
+
+/// Generate code for a boolean value known at compilation time.
+/// If the next instruction is if_true, the branch is resolved
+/// statically, and the untaken successor is never compiled.
+void genKnownBool(
+    BlockVersion* version,
+    CodeGenCtx& ctx,
+    Array& instrs,
+    size_t& i,
+    bool val
+)
+{
+    if (getOp(instrs, i + 1) == OP_IF_TRUE)
+    {
+        i += 1;
+        auto branchInstr = (Object)instrs.getElem(i);
+
+        static ICache thenIC("then");
+        static ICache elseIC("else");
+        auto dstBB = val? thenIC.getObj(branchInstr):elseIC.getObj(branchInstr);
+        auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
+
+        writeCode(JUMP_STUB);
+        writeCode(dstVer);
+        return;
+    }
+
+    auto boolVal = val? Value::TRUE:Value::FALSE;
+    ctx.push(TAG_BOOL);
+    writeCode(PUSH);
+    writeCode(boolVal.getWord());
+    writeCode(boolVal.getTag());
+}
+
+/// Generate a conditional branch instruction. The branch targets
+/// are patched once the successor versions get compiled.
+void genBranch(
+    BlockVersion* version,
+    Opcode branchOp,
+    Object branchInstr,
+    const CodeGenCtx& thenCtx,
+    const CodeGenCtx& elseCtx
+)
+{
+    static ICache thenIC("then");
+    static ICache elseIC("else");
+    auto thenBB = thenIC.getObj(branchInstr);
+    auto elseBB = elseIC.getObj(branchInstr);
+    auto thenVer = getBlockVersion(version->fun, thenBB, thenCtx);
+    auto elseVer = getBlockVersion(version->fun, elseBB, elseCtx);
+
+    writeCode(branchOp);
+    writeCode((uint8_t*)nullptr);
+    writeCode((uint8_t*)nullptr);
+    writeCode(thenVer);
+    writeCode(elseVer);
+}
+
+/// Maximum number of block instructions fused into a superinstruction
+const size_t MAX_FUSED = 4;
+
+/**
+Superinstruction code generation function. Receives the index of the
+first matched instruction. Returns false if the instructions cannot be
+fused, in which case they get compiled individually.
+*/
+typedef bool (*FuseFn)(
+    BlockVersion* version,
+    CodeGenCtx& ctx,
+    Array& instrs,
+    size_t i,
+    Opcode superOp
+);
+
+/// Rule fusing a sequence of block instructions into a superinstruction
+struct FusionRule
+{
+    /// Sequence of block instruction opcodes to match
+    BlockOp ops[MAX_FUSED];
+    size_t numOps;
+
+    /// Superinstruction opcode generated
+    Opcode superOp;
+
+    /// Code generation function
+    FuseFn gen;
+};
+
+/// Get the local variable index operand of the ith block instruction
+uint16_t getLocalIdx(Array& instrs, size_t i)
+{
+    static ICache idxIC("idx");
+    return (uint16_t)idxIC.getInt32(instrs.getElem(i));
+}
+
+/// push 1 + add_i32 or sub_i32 => increment or decrement
+bool fuseIncDec(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    static ICache valIC("val");
+    if (valIC.getField(instrs.getElem(i)) != Value::ONE)
+        return false;
+
+    ctx.pop();
+    ctx.push(TAG_INT32);
+    writeCode(superOp);
+    return true;
+}
+
+/// push name + get_field => field access with a constant name
+bool fuseGetFieldImm(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    static ICache valIC("val");
+    auto name = valIC.getField(instrs.getElem(i));
+    if (!name.isString())
+        return false;
+
+    ctx.pop();
+    ctx.push(TAG_UNKNOWN);
+    writeCode(superOp);
+    writeCode((refptr)String(name));
+    writeCode(FieldCache());
+    return true;
+}
+
+/// push name + has_field => field test with a constant name
+bool fuseHasFieldImm(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    static ICache valIC("val");
+    auto name = valIC.getField(instrs.getElem(i));
+    if (!name.isString())
+        return false;
+
+    ctx.pop();
+    ctx.push(TAG_BOOL);
+    writeCode(superOp);
+    writeCode((refptr)String(name));
+    writeCode(FieldCache());
+    return true;
+}
+
+/// push name + dup 2 + set_field => field assignment with a constant
+/// name, leaving the assigned value on the stack
+bool fuseSetFieldImm(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    static ICache valIC("val");
+    static ICache idxIC("idx");
+    auto name = valIC.getField(instrs.getElem(i));
+    if (!name.isString() || idxIC.getInt32(instrs.getElem(i + 1)) != 2)
+        return false;
+
+    ctx.pop();
+    writeCode(superOp);
+    writeCode((refptr)String(name));
+    writeCode(FieldCache());
+    return true;
+}
+
+/// get_local a + get_local b + add_i32 + set_local c => c = a + b
+bool fuseAddLocals(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    auto idx0 = getLocalIdx(instrs, i);
+    auto idx1 = getLocalIdx(instrs, i + 1);
+    auto dstIdx = getLocalIdx(instrs, i + 3);
+
+    ctx.setLocal(dstIdx, TAG_INT32);
+    writeCode(superOp);
+    writeCode(idx0);
+    writeCode(idx1);
+    writeCode(dstIdx);
+    return true;
+}
+
+/// Integer comparison + if_true => compare and branch
+bool fuseCmpBranch(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    ctx.pop(2);
+    genBranch(version, superOp, instrs.getElem(i + 1), ctx, ctx);
+    return true;
+}
+
+/// get_local + get_elem => array element access with a local index
+bool fuseGetElemLocal(BlockVersion* version, CodeGenCtx& ctx, Array& instrs, size_t i, Opcode superOp)
+{
+    ctx.pop();
+    ctx.push(TAG_UNKNOWN);
+    writeCode(superOp);
+    writeCode(getLocalIdx(instrs, i));
+    return true;
+}
+
+/// Superinstruction fusion rules, longest sequences first
+const FusionRule fusionRules[] =
+{
+    { { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD_I32, OP_SET_LOCAL }, 4, ADD_LOCALS_I32, fuseAddLocals },
+    { { OP_PUSH, OP_ADD_I32 }, 2, INC_I32, fuseIncDec },
+    { { OP_PUSH, OP_SUB_I32 }, 2, DEC_I32, fuseIncDec },
+    { { OP_PUSH, OP_DUP, OP_SET_FIELD }, 3, SET_FIELD_IMM, fuseSetFieldImm },
+    { { OP_PUSH, OP_GET_FIELD }, 2, GET_FIELD_IMM, fuseGetFieldImm },
+    { { OP_PUSH, OP_HAS_FIELD }, 2, HAS_FIELD_IMM, fuseHasFieldImm },
+    { { OP_LT_I32, OP_IF_TRUE }, 2, IF_LT_I32, fuseCmpBranch },
+    { { OP_LE_I32, OP_IF_TRUE }, 2, IF_LE_I32, fuseCmpBranch },
+    { { OP_GT_I32, OP_IF_TRUE }, 2, IF_GT_I32, fuseCmpBranch },
+    { { OP_GE_I32, OP_IF_TRUE }, 2, IF_GE_I32, fuseCmpBranch },
+    { { OP_EQ_I32, OP_IF_TRUE }, 2, IF_EQ_I32, fuseCmpBranch },
+    { { OP_GET_LOCAL, OP_GET_ELEM }, 2, GET_ELEM_LOCAL, fuseGetElemLocal },
+};
+
+/**
+Peephole fusion stage. Tries the fusion rules matching the instruction
+sequence starting at index i, and advances i past the fused instructions
+if a superinstruction was generated.
+*/
+bool fuseInstrs(
+    BlockVersion* version,
+    CodeGenCtx& ctx,
+    Array& instrs,
+    size_t& i,
+    BlockOp op
+)
+{
+    for (auto& rule : fusionRules)
+    {
+        if (rule.ops[0] != op)
+            continue;
+
+        size_t numMatched = 1;
+        while (numMatched < rule.numOps &&
+               getOp(instrs, i + numMatched) == rule.ops[numMatched])
+            numMatched++;
+
+        if (numMatched < rule.numOps)
+            continue;
+
+        if (rule.gen(version, ctx, instrs, i, rule.superOp))
+        {
+            i += rule.numOps - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void compile(BlockVersion* version)
+{
+    //std::cout << "compiling version" << std::endl;
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto block = version->block;
+
+    // Get the instructions array
+    static ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+
+    if (instrs.length() == 0)
+    {
+        throw RunError("empty basic block");
+    }
+
+    // Make sure the whole block fits in the current segment
+    reserveCode((instrs.length() + 1) * MAX_INSTR_SIZE, version);
+
+    // Mark the block start
+    version->startPtr = codeHeapAlloc;
+    version->segment = curSegment;
+    curSegment->versions.push_back(version);
+
+    // Count entries into this version, to compute how many
+    // times each pair of instructions in the block gets executed
+    if (opPairsEnabled)
+    {
+        writeCode(PROFILE_ENTRY);
+        writeCode(version);
+    }
+
+    // Check for a profiler sample to take in this version
+    if (profileEnabled)
+        writeCode(PROFILE_SAMPLE);
+
+    // Count entries into this version, so that it
+    // can be compiled to native code once hot
+    if (jitEnabled)
+    {
+        writeCode(COUNT_ENTRY);
+        writeCode(EntryCounter());
+    }
+
+    // Copy the code generation context at the beginning of this version
+    auto ctx = version->ctx;
+
+    // Most recent test of the tag of a local variable. This is used
+    // to refine the known types in the branches of if_true.
+    size_t testInstrIdx = SIZE_MAX;
+    uint16_t testLocalIdx = 0;
+    Tag testTag = TAG_UNKNOWN;
 
     // For each instruction
     for (size_t i = 0; i < instrs.length(); ++i)
@@ -489,681 +1806,1259 @@ void compile(BlockVersion* version)
         assert (instrVal.isObject());
         auto instr = (Object)instrVal;
 
-        static ICache opIC("op");
-        auto op = (std::string)opIC.getStr(instr);
+        auto op = getBlockOp(instr);
+
+        //std::cout << "op: " << op << std::endl;
+        //std::cout << "  numTmps=" << ctx.numTmps() << std::endl;
+
+        // Try to compile a sequence of instructions into a superinstruction
+        if (fuseInstrs(version, ctx, instrs, i, op))
+        {
+            continue;
+        }
+
+        switch (op)
+        {
+            case OP_PUSH:
+            {
+                static ICache valIC("val");
+                auto val = valIC.getField(instr);
+
+                ctx.push(val.getTag());
+                writeCode(PUSH);
+                writeCode(val.getWord());
+                writeCode(val.getTag());
+                continue;
+            }
+
+            case OP_POP:
+            {
+                ctx.pop();
+                writeCode(POP);
+                continue;
+            }
+
+            case OP_DUP:
+            {
+                static ICache idxIC("idx");
+                auto idx = (uint16_t)idxIC.getInt32(instr);
+                ctx.push(ctx.getTmp(idx));
+                writeCode(DUP);
+                writeCode(idx);
+                continue;
+            }
+
+            case OP_SWAP:
+            {
+                auto tag0 = ctx.pop();
+                auto tag1 = ctx.pop();
+                ctx.push(tag0);
+                ctx.push(tag1);
+                writeCode(SWAP);
+                continue;
+            }
+
+            case OP_GET_LOCAL:
+            {
+                static ICache idxIC("idx");
+                auto idx = (uint16_t)idxIC.getInt32(instr);
+                if (getOp(instrs, i + 1) == OP_HAS_TAG)
+                {
+                    auto nextInstr = (Object) instrs.getElem(i + 1);
+                    static ICache tagIC("tag");
+                    auto tagStr = (std::string)tagIC.getStr(nextInstr);
+                    auto tag = strToTag(tagStr);
+                    i += 1;
+
+                    // If the tag of the local is known, resolve the test statically
+                    auto localTag = ctx.getLocal(idx);
+                    if (localTag != TAG_UNKNOWN)
+                    {
+                        genKnownBool(version, ctx, instrs, i, localTag == tag);
+                        continue;
+                    }
+
+                    testInstrIdx = i;
+                    testLocalIdx = idx;
+                    testTag = tag;
+
+                    ctx.push(TAG_BOOL);
+                    writeCode(LOCAL_HAS_TAG);
+                    writeCode(idx);
+                    writeCode(tag);
+                    continue;
+                }
+
+                ctx.push(ctx.getLocal(idx));
+                writeCode(GET_LOCAL);
+                writeCode(idx);
+                continue;
+            }
+
+            case OP_SET_LOCAL:
+            {
+                static ICache idxIC("idx");
+                auto idx = (uint16_t)idxIC.getInt32(instr);
+                ctx.setLocal(idx, ctx.pop());
+                writeCode(SET_LOCAL);
+                writeCode(idx);
+                continue;
+            }
+
+            //
+            // Integer operations
+            //
+
+            case OP_ADD_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(ADD_I32);
+                continue;
+            }
+
+            case OP_SUB_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(SUB_I32);
+                continue;
+            }
+
+            case OP_MUL_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(MUL_I32);
+                continue;
+            }
+
+            case OP_DIV_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(DIV_I32);
+                continue;
+            }
+
+            case OP_MOD_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(MOD_I32);
+                continue;
+            }
+
+            case OP_SHL_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(SHL_I32);
+                continue;
+            }
+
+            case OP_SHR_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(SHR_I32);
+                continue;
+            }
+
+            case OP_USHR_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(USHR_I32);
+                continue;
+            }
+
+            case OP_AND_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(AND_I32);
+                continue;
+            }
+
+            case OP_OR_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(OR_I32);
+                continue;
+            }
+
+            case OP_XOR_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(XOR_I32);
+                continue;
+            }
+
+            case OP_NOT_I32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
+                writeCode(NOT_I32);
+                continue;
+            }
+
+            case OP_LT_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(LT_I32);
+                continue;
+            }
+
+            case OP_LE_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(LE_I32);
+                continue;
+            }
+
+            case OP_GT_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(GT_I32);
+                continue;
+            }
+
+            case OP_GE_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(GE_I32);
+                continue;
+            }
+
+            case OP_EQ_I32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_I32);
+                continue;
+            }
+
+            //
+            // Floating-point ops
+            //
+
+            case OP_ADD_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_FLOAT32);
+                writeCode(ADD_F32);
+                continue;
+            }
+
+            case OP_SUB_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_FLOAT32);
+                writeCode(SUB_F32);
+                continue;
+            }
+
+            case OP_MUL_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_FLOAT32);
+                writeCode(MUL_F32);
+                continue;
+            }
+
+            case OP_DIV_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_FLOAT32);
+                writeCode(DIV_F32);
+                continue;
+            }
+
+            case OP_LT_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(LT_F32);
+                continue;
+            }
+
+            case OP_LE_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(LE_F32);
+                continue;
+            }
+
+            case OP_GT_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(GT_F32);
+                continue;
+            }
+
+            case OP_GE_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(GE_F32);
+                continue;
+            }
+
+            case OP_EQ_F32:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_F32);
+                continue;
+            }
+
+            case OP_SIN_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(SIN_F32);
+                continue;
+            }
+
+            case OP_COS_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(COS_F32);
+                continue;
+            }
+
+            case OP_SQRT_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(SQRT_F32);
+                continue;
+            }
+
+            case OP_LOG_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(LOG_F32);
+                continue;
+            }
+
+            case OP_EXP_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(EXP_F32);
+                continue;
+            }
+
+            //
+            // Conversion ops
+            //
+
+            case OP_I32_TO_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(I32_TO_F32);
+                continue;
+            }
+
+            case OP_I32_TO_STR:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_STRING);
+                writeCode(I32_TO_STR);
+                continue;
+            }
+
+            case OP_F32_TO_I32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
+                writeCode(F32_TO_I32);
+                continue;
+            }
+
+            case OP_F32_TO_STR:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_STRING);
+                writeCode(F32_TO_STR);
+                continue;
+            }
+
+            case OP_STR_TO_F32:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_FLOAT32);
+                writeCode(STR_TO_F32);
+                continue;
+            }
+
+            //
+            // Miscellaneous ops
+            //
+
+            case OP_EQ_BOOL:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_BOOL);
+                continue;
+            }
+
+            case OP_HAS_TAG:
+            {
+                static ICache tagIC("tag");
+                auto tagStr = (std::string)tagIC.getStr(instr);
+                auto tag = strToTag(tagStr);
+
+                // If the tag of the value is known, resolve the test statically
+                auto valTag = ctx.pop();
+                if (valTag != TAG_UNKNOWN)
+                {
+                    writeCode(POP);
+                    genKnownBool(version, ctx, instrs, i, valTag == tag);
+                    continue;
+                }
+
+                ctx.push(TAG_BOOL);
+                writeCode(HAS_TAG);
+                writeCode(tag);
+                continue;
+            }
+
+            case OP_GET_TAG:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_STRING);
+                writeCode(GET_TAG);
+                continue;
+            }
+
+            //
+            // String operations
+            //
+
+            case OP_STR_LEN:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
+                writeCode(STR_LEN);
+                continue;
+            }
 
-        //std::cout << "op: " << op << std::endl;
-        //std::cout << "  numTmps=" << numTmps << std::endl;
+            case OP_GET_CHAR:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_STRING);
+                writeCode(GET_CHAR);
+                continue;
+            }
 
-        if (op == "push")
-        {
-            static ICache valIC("val");
-            auto val = valIC.getField(instr);
-            std::string nextOp = getOp(instrs, i + 1);
+            case OP_GET_CHAR_CODE:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_INT32);
+                writeCode(GET_CHAR_CODE);
+                continue;
+            }
 
-            if (nextOp == "add_i32" && val == Value::ONE)
+            case OP_CHAR_TO_STR:
             {
-                i += 1;
-                writeCode(INC_I32);
+                ctx.pop(1);
+                ctx.push(TAG_STRING);
+                writeCode(CHAR_TO_STR);
                 continue;
             }
 
-            if (nextOp == "sub_i32" && val == Value::ONE)
+            case OP_STR_CAT:
             {
-                i += 1;
-                writeCode(DEC_I32);
+                ctx.pop(2);
+                ctx.push(TAG_STRING);
+                writeCode(STR_CAT);
                 continue;
             }
 
-            if (nextOp == "get_field")
+            case OP_EQ_STR:
             {
-                i += 1;
-                writeCode(GET_FIELD_IMM);
-                writeCode((refptr)val);
-                writeCode(size_t(0));
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_STR);
                 continue;
             }
 
-            numTmps += 1;
-            writeCode(PUSH);
-            writeCode(val.getWord());
-            writeCode(val.getTag());
-            continue;
-        }
+            //
+            // Object operations
+            //
 
-        if (op == "pop")
-        {
-            numTmps -= 1;
-            writeCode(POP);
-            continue;
-        }
+            case OP_NEW_OBJECT:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_OBJECT);
+                writeCode(NEW_OBJECT);
+                continue;
+            }
 
-        if (op == "dup")
-        {
-            numTmps += 1;
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(DUP);
-            writeCode(idx);
-            continue;
-        }
+            case OP_HAS_FIELD:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(HAS_FIELD);
 
-        if (op == "swap")
-        {
-            writeCode(SWAP);
-            continue;
-        }
+                // Cached object shape and slot index
+                writeCode(FieldCache());
 
-        if (op == "get_local")
-        {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            if (getOp(instrs, i + 1) == "has_tag")
+                continue;
+            }
+
+            case OP_SET_FIELD:
             {
-                numTmps += 1;
-                auto nextInstr = (Object) instrs.getElem(i + 1);
-                static ICache tagIC("tag");
-                auto tagStr = (std::string)tagIC.getStr(nextInstr);
-                auto tag = strToTag(tagStr);
-                writeCode(LOCAL_HAS_TAG);
-                writeCode(idx);
-                writeCode(tag);
-                i += 1;
+                ctx.pop(3);
+                writeCode(SET_FIELD);
+
+                // Cached object shape and slot index
+                writeCode(FieldCache());
+
                 continue;
             }
 
-            numTmps += 1;
-            writeCode(GET_LOCAL);
-            writeCode(idx);
-            continue;
-        }
+            case OP_GET_FIELD:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_UNKNOWN);
+                writeCode(GET_FIELD);
 
-        if (op == "set_local")
-        {
-            numTmps -= 1;
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(SET_LOCAL);
-            writeCode(idx);
-            continue;
-        }
+                // Cached object shape and slot index
+                writeCode(FieldCache());
 
-        //
-        // Integer operations
-        //
+                continue;
+            }
 
-        if (op == "add_i32")
-        {
-            numTmps -= 1;
-            writeCode(ADD_I32);
-            continue;
-        }
+            case OP_GET_FIELD_LIST:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_ARRAY);
+                writeCode(GET_FIELD_LIST);
+                continue;
+            }
 
-        if (op == "sub_i32")
-        {
-            numTmps -= 1;
-            writeCode(SUB_I32);
-            continue;
-        }
+            case OP_EQ_OBJ:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_OBJ);
+                continue;
+            }
 
-        if (op == "mul_i32")
-        {
-            numTmps -= 1;
-            writeCode(MUL_I32);
-            continue;
-        }
+            //
+            // Array operations
+            //
 
-        if (op == "div_i32")
-        {
-            numTmps -= 1;
-            writeCode(DIV_I32);
-            continue;
-        }
+            case OP_NEW_ARRAY:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_ARRAY);
+                writeCode(NEW_ARRAY);
+                continue;
+            }
 
-        if (op == "mod_i32")
-        {
-            numTmps -= 1;
-            writeCode(MOD_I32);
-            continue;
-        }
+            case OP_ARRAY_LEN:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_INT32);
+                writeCode(ARRAY_LEN);
+                continue;
+            }
 
-        if (op == "shl_i32")
-        {
-            numTmps -= 1;
-            writeCode(SHL_I32);
-            continue;
-        }
+            case OP_ARRAY_PUSH:
+            {
+                ctx.pop(2);
+                writeCode(ARRAY_PUSH);
+                continue;
+            }
 
-        if (op == "shr_i32")
-        {
-            numTmps -= 1;
-            writeCode(SHR_I32);
-            continue;
-        }
+            case OP_ARRAY_POP:
+            {
+                ctx.pop(1);
+                ctx.push(TAG_UNKNOWN);
+                writeCode(ARRAY_POP);
+                continue;
+            }
 
-        if (op == "ushr_i32")
-        {
-            numTmps -= 1;
-            writeCode(USHR_I32);
-            continue;
-        }
+            case OP_SET_ELEM:
+            {
+                ctx.pop(3);
+                writeCode(SET_ELEM);
+                continue;
+            }
 
-        if (op == "and_i32")
-        {
-            numTmps -= 1;
-            writeCode(AND_I32);
-            continue;
-        }
+            case OP_GET_ELEM:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_UNKNOWN);
+                writeCode(GET_ELEM);
+                continue;
+            }
 
-        if (op == "or_i32")
-        {
-            numTmps -= 1;
-            writeCode(OR_I32);
-            continue;
-        }
+            case OP_EQ_ARRAY:
+            {
+                ctx.pop(2);
+                ctx.push(TAG_BOOL);
+                writeCode(EQ_ARRAY);
+                continue;
+            }
 
-        if (op == "xor_i32")
-        {
-            numTmps -= 1;
-            writeCode(XOR_I32);
-            continue;
-        }
+            //
+            // Branch instructions
+            //
 
-        if (op == "not_i32")
-        {
-            writeCode(NOT_I32);
-            continue;
-        }
+            case OP_JUMP:
+            {
+                static ICache toIC("to");
+                auto dstBB = toIC.getObj(instr);
+                auto dstVer = getBlockVersion(version->fun, dstBB, ctx);
 
-        if (op == "lt_i32")
-        {
-            numTmps -= 1;
-            writeCode(LT_I32);
-            continue;
-        }
+                writeCode(JUMP_STUB);
+                writeCode(dstVer);
+                continue;
+            }
 
-        if (op == "le_i32")
-        {
-            numTmps -= 1;
-            writeCode(LE_I32);
-            continue;
-        }
+            case OP_IF_TRUE:
+            {
+                ctx.pop();
 
-        if (op == "gt_i32")
-        {
-            numTmps -= 1;
-            writeCode(GT_I32);
-            continue;
-        }
+                // If the branch condition is a tag test on a local variable,
+                // the tag of that local is known in the then branch
+                auto thenCtx = ctx;
+                if (i > 0 && testInstrIdx == i - 1)
+                    thenCtx.setLocal(testLocalIdx, testTag);
 
-        if (op == "ge_i32")
-        {
-            numTmps -= 1;
-            writeCode(GE_I32);
-            continue;
-        }
+                genBranch(version, IF_TRUE, instr, thenCtx, ctx);
+                continue;
+            }
 
-        if (op == "eq_i32")
-        {
-            numTmps -= 1;
-            writeCode(EQ_I32);
-            continue;
-        }
+            case OP_CALL:
+            {
+                static ICache numArgsCache("num_args");
+                auto numArgs = (int16_t)numArgsCache.getInt32(instr);
+
+                genCall(
+                    version,
+                    instr,
+                    numArgs,
+                    ctx
+                );
+
+                continue;
+            }
 
-        //
-        // Floating-point ops
-        //
+            case OP_RET:
+            {
+                ctx.pop();
 
-        if (op == "add_f32")
-        {
-            numTmps -= 1;
-            writeCode(ADD_F32);
-            continue;
-        }
+                // TODO: should report source position (src_pos)
+                // of function if this check fails
+                if (ctx.numTmps() != 0)
+                {
+                    throw RunError(
+                        "there must be no values left on the temporary stack "
+                        "when returning from a function"
+                    );
+                }
 
-        if (op == "sub_f32")
-        {
-            numTmps -= 1;
-            writeCode(SUB_F32);
-            continue;
-        }
+                writeCode(RET);
+                continue;
+            }
 
-        if (op == "mul_f32")
-        {
-            numTmps -= 1;
-            writeCode(MUL_F32);
-            continue;
+            case OP_THROW:
+            {
+                ctx.pop();
+                writeCode(THROW);
+                continue;
+            }
+
+            case OP_IMPORT:
+            {
+                // Push the import function on the stack
+                ctx.push(TAG_HOSTFN);
+                writeCode(PUSH);
+                writeCode((Word)(refptr)&importFn);
+                writeCode((Tag)TAG_HOSTFN);
+
+                // Call the import function
+                genCall(
+                    version,
+                    instr,
+                    1,
+                    ctx
+                );
+
+                continue;
+            }
+
+            default:
+            break;
         }
 
-        if (op == "div_f32")
+        static ICache opIC("op");
+        auto opName = (std::string)opIC.getStr(instr);
+        throw RunError("unhandled opcode in basic block \"" + opName + "\"");
+    }
+
+    // Mark the block end
+    version->endPtr = codeHeapAlloc;
+
+    auto endTime = std::chrono::steady_clock::now();
+    compileTimeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        endTime - startTime
+    ).count();
+    compileCount++;
+
+    //std::cout << "done compiling version" << std::endl;
+    //std::cout << codeHeapSize() << std::endl;
+}
+
+/// Get the opcode for its code heap representation
+Opcode decodeOp(OpVal opVal)
+{
+#ifdef THREADED_DISPATCH
+    for (size_t i = 0; i < NUM_OPCODES; ++i)
+        if (opHandlers[i] == opVal)
+            return (Opcode)i;
+    assert (false && "unknown instruction handler");
+    return NUM_OPCODES;
+#else
+    return opVal;
+#endif
+}
+
+/// Read a value from the code heap at a given position
+template <typename T> T readCodeAt(uint8_t*& codePtr)
+{
+    T val = *(T*)codePtr;
+    codePtr += sizeof(T);
+    return val;
+}
+
+/// Compile a sequence of interpreter instructions to native code.
+/// Compilation stops at the first instruction which has no native
+/// implementation, where execution resumes in the interpreter. This
+/// is notably the case for all branches, calls and returns, so native
+/// code shares the branch stubs and call protocol of the interpreter.
+NativeFn jitCompile(uint8_t* startPtr)
+{
+    NativeBlock block(&stackPtr, &framePtr, &stackLimit, &instrPtr);
+
+    auto codePtr = startPtr;
+
+    for (;;)
+    {
+        auto instrAddr = codePtr;
+        auto op = decodeOp(readCodeAt<OpVal>(codePtr));
+
+        switch (op)
         {
-            numTmps -= 1;
-            writeCode(DIV_F32);
+            case PUSH:
+            {
+                auto word = readCodeAt<Word>(codePtr);
+                auto tag = readCodeAt<Tag>(codePtr);
+                block.beginInstr(instrAddr);
+                block.push(word, tag);
+            }
             continue;
-        }
 
-        if (op == "lt_f32")
-        {
-            numTmps -= 1;
-            writeCode(LT_F32);
+            case POP:
+            block.beginInstr(instrAddr);
+            block.pop();
             continue;
-        }
 
-        if (op == "le_f32")
-        {
-            numTmps -= 1;
-            writeCode(LE_F32);
+            case DUP:
+            block.beginInstr(instrAddr);
+            block.dup(readCodeAt<uint16_t>(codePtr));
             continue;
-        }
 
-        if (op == "gt_f32")
-        {
-            numTmps -= 1;
-            writeCode(GT_F32);
+            case SWAP:
+            block.beginInstr(instrAddr);
+            block.swap();
             continue;
-        }
 
-        if (op == "ge_f32")
-        {
-            numTmps -= 1;
-            writeCode(GE_F32);
+            case GET_LOCAL:
+            block.beginInstr(instrAddr);
+            block.getLocal(readCodeAt<uint16_t>(codePtr));
             continue;
-        }
 
-        if (op == "eq_f32")
-        {
-            numTmps -= 1;
-            writeCode(EQ_F32);
+            case SET_LOCAL:
+            block.beginInstr(instrAddr);
+            block.setLocal(readCodeAt<uint16_t>(codePtr));
             continue;
-        }
 
-        if (op == "sin_f32")
-        {
-            numTmps += 0;
-            writeCode(SIN_F32);
+            case LOCAL_HAS_TAG:
+            {
+                auto idx = readCodeAt<uint16_t>(codePtr);
+                auto tag = readCodeAt<Tag>(codePtr);
+                block.beginInstr(instrAddr);
+                block.localHasTag(idx, tag);
+            }
             continue;
-        }
 
-        if (op == "cos_f32")
-        {
-            numTmps += 0;
-            writeCode(COS_F32);
+            case HAS_TAG:
+            block.beginInstr(instrAddr);
+            block.hasTag(readCodeAt<Tag>(codePtr));
             continue;
-        }
 
-        if (op == "sqrt_f32")
-        {
-            numTmps += 0;
-            writeCode(SQRT_F32);
+            case INC_I32:
+            block.beginInstr(instrAddr);
+            block.intAddImm(1);
             continue;
-        }
 
-        if (op == "log_f32")
-        {
-            numTmps += 0;
-            writeCode(LOG_F32);
+            case DEC_I32:
+            block.beginInstr(instrAddr);
+            block.intAddImm(-1);
             continue;
-        }
 
-        if (op == "exp_f32")
-        {
-            numTmps += 0;
-            writeCode(EXP_F32);
+            case ADD_LOCALS_I32:
+            {
+                auto idx0 = readCodeAt<uint16_t>(codePtr);
+                auto idx1 = readCodeAt<uint16_t>(codePtr);
+                auto dstIdx = readCodeAt<uint16_t>(codePtr);
+                block.beginInstr(instrAddr);
+
+                // Check the operand types before anything gets pushed, so
+                // that a failing guard resumes here with the stack intact
+                block.guardLocalTag(idx0, TAG_INT32);
+                block.guardLocalTag(idx1, TAG_INT32);
+                block.getLocal(idx0);
+                block.getLocal(idx1);
+                block.intOp(NATIVE_ADD);
+                block.setLocal(dstIdx);
+            }
             continue;
-        }
 
-        //
-        // Conversion ops
-        //
+            case ADD_I32: block.beginInstr(instrAddr); block.intOp(NATIVE_ADD); continue;
+            case SUB_I32: block.beginInstr(instrAddr); block.intOp(NATIVE_SUB); continue;
+            case MUL_I32: block.beginInstr(instrAddr); block.intOp(NATIVE_MUL); continue;
+            case AND_I32: block.beginInstr(instrAddr); block.intOp(NATIVE_AND); continue;
+            case OR_I32:  block.beginInstr(instrAddr); block.intOp(NATIVE_OR); continue;
+            case XOR_I32: block.beginInstr(instrAddr); block.intOp(NATIVE_XOR); continue;
 
-        if (op == "i32_to_f32")
-        {
-            writeCode(I32_TO_F32);
-            continue;
-        }
+            case LT_I32: block.beginInstr(instrAddr); block.intCmp(NATIVE_LT); continue;
+            case LE_I32: block.beginInstr(instrAddr); block.intCmp(NATIVE_LE); continue;
+            case GT_I32: block.beginInstr(instrAddr); block.intCmp(NATIVE_GT); continue;
+            case GE_I32: block.beginInstr(instrAddr); block.intCmp(NATIVE_GE); continue;
+            case EQ_I32: block.beginInstr(instrAddr); block.intCmp(NATIVE_EQ); continue;
 
-        if (op == "i32_to_str")
-        {
-            writeCode(I32_TO_STR);
-            continue;
+            // Unsupported instruction, resume in the interpreter
+            default:
+            {
+                if (block.length() == 0)
+                    return nullptr;
+
+                return block.finish(instrAddr);
+            }
         }
+    }
+}
 
-        if (op == "f32_to_i32")
-        {
-            writeCode(F32_TO_I32);
+/**
+Find the block version containing a given code address. This does a
+binary search in the version table of the segment holding the address.
+*/
+BlockVersion* findVersion(uint8_t* codePtr)
+{
+    for (auto segment : codeSegments)
+    {
+        if (codePtr < segment->start || codePtr >= segment->limit)
             continue;
-        }
 
-        if (op == "f32_to_str")
-        {
-            writeCode(F32_TO_STR);
-            continue;
-        }
+        auto& versions = segment->versions;
+
+        // Find the last version starting at or before the address
+        auto itr = std::upper_bound(
+            versions.begin(),
+            versions.end(),
+            codePtr,
+            [](uint8_t* ptr, BlockVersion* v) { return ptr < v->startPtr; }
+        );
+
+        if (itr == versions.begin())
+            return nullptr;
+
+        return *(itr - 1);
+    }
+
+    return nullptr;
+}
 
-        if (op == "str_to_f32")
-        {
-            writeCode(STR_TO_F32);
-            continue;
-        }
+/// Get the last source position found in the block of a version
+Value getSrcPos(BlockVersion* version)
+{
+    auto block = version->block;
 
-        //
-        // Miscellaneous ops
-        //
+    static ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+    assert (instrs.length() > 0);
 
-        if (op == "eq_bool")
-        {
-            numTmps -= 1;
-            writeCode(EQ_BOOL);
-            continue;
-        }
+    // Traverse the instructions in reverse
+    for (int i = (int)instrs.length() - 1; i >= 0; --i)
+    {
+        auto instrVal = instrs.getElem(i);
+        assert (instrVal.isObject());
+        auto instr = Object(instrVal);
 
-        if (op == "has_tag")
-        {
-            numTmps += 0;
-            static ICache tagIC("tag");
-            auto tagStr = (std::string)tagIC.getStr(instr);
-            auto tag = strToTag(tagStr);
+        if (instr.hasField("src_pos"))
+            return instr.getField("src_pos");
+    }
 
-            writeCode(HAS_TAG);
-            writeCode(tag);
-            continue;
-        }
+    return Value::UNDEF;
+}
 
-        if (op == "get_tag")
-        {
-            numTmps += 0;
-            writeCode(GET_TAG);
-            continue;
-        }
+/// Get the source position for a given instruction, if available
+Value getSrcPos(uint8_t* instrPtr)
+{
+    auto version = findVersion(instrPtr);
+    if (!version)
+    {
+        std::cout << "no instr to block mapping" << std::endl;
+        return Value::UNDEF;
+    }
 
-        //
-        // String operations
-        //
+    return getSrcPos(version);
+}
 
-        if (op == "str_len")
-        {
-            numTmps += 0;
-            writeCode(STR_LEN);
-            continue;
-        }
+/// Sampling period of the profiler, in microseconds of CPU time
+const long PROF_PERIOD_US = 1000;
 
-        if (op == "get_char")
-        {
-            numTmps -= 1;
-            writeCode(GET_CHAR);
-            continue;
-        }
+/// Maximum number of frames recorded in a profiler sample
+const size_t PROF_MAX_DEPTH = 256;
 
-        if (op == "get_char_code")
-        {
-            numTmps -= 1;
-            writeCode(GET_CHAR_CODE);
-            continue;
-        }
+/// Instruction pointer recorded by the profiling timer, consumed by
+/// the next block entered. Null when no sample is pending.
+uint8_t* volatile profSampleAddr = nullptr;
 
-        if (op == "char_to_str")
-        {
-            numTmps += 0;
-            writeCode(CHAR_TO_STR);
-            continue;
-        }
+/// Number of samples taken, and number of samples per collapsed stack
+uint64_t profNumSamples = 0;
+std::unordered_map<std::string, uint64_t> profStacks;
 
-        if (op == "str_cat")
-        {
-            numTmps -= 1;
-            writeCode(STR_CAT);
-            continue;
-        }
+/// Number of samples in which a function is the innermost one
+/// (self), or appears anywhere on the stack (total)
+std::unordered_map<std::string, uint64_t> profSelf;
+std::unordered_map<std::string, uint64_t> profTotal;
 
-        if (op == "eq_str")
-        {
-            numTmps -= 1;
-            writeCode(EQ_STR);
-            continue;
-        }
+/// Number of samples per innermost source position
+std::unordered_map<std::string, uint64_t> profPositions;
 
-        //
-        // Object operations
-        //
+/// Profiling timer signal handler. This only records the instruction
+/// pointer, since the interpreter state may be inconsistent here. The
+/// sample is taken at the next block entry.
+void profSignalHandler(int)
+{
+    if (!profSampleAddr)
+        profSampleAddr = instrPtr;
+}
 
-        if (op == "new_object")
-        {
-            numTmps += 0;
-            writeCode(NEW_OBJECT);
-            continue;
-        }
+/// Get a name identifying a function in profiles
+std::string profFunName(Object fun)
+{
+    static ICache nameIC("name");
+    static ICache srcPosIC("src_pos");
 
-        if (op == "has_field")
-        {
-            numTmps -= 1;
-            writeCode(HAS_FIELD);
-            continue;
-        }
+    if (fun.hasField("name"))
+    {
+        auto name = nameIC.getField(fun);
+        if (name.isString())
+            return (std::string)name;
+    }
 
-        if (op == "set_field")
-        {
-            numTmps -= 3;
-            writeCode(SET_FIELD);
-            continue;
-        }
+    // Functions without a name are identified by their definition
+    if (fun.hasField("src_pos"))
+    {
+        auto srcPos = srcPosIC.getField(fun);
+        if (srcPos.isObject())
+            return "function@" + posToString(srcPos);
+    }
 
-        if (op == "get_field")
-        {
-            numTmps -= 1;
+    return "<anonymous>";
+}
 
-            writeCode(GET_FIELD);
+/// Names of the functions and source positions found in profiles
+std::unordered_set<std::string> profNames;
 
-            // Cached property slot index
-            writeCode(size_t(0));
+/// Get the name of the function of a version in profiles. Names are
+/// cached on versions, since samples can have many frames.
+const std::string& profFunName(BlockVersion* version)
+{
+    if (!version->profName)
+        version->profName = &*profNames.insert(profFunName(version->fun)).first;
+    return *version->profName;
+}
 
-            continue;
-        }
+/// Get the name of the source position of a version in profiles,
+/// or the name of its function if the position is unknown
+const std::string& profPosName(BlockVersion* version)
+{
+    if (!version->profPos)
+    {
+        auto srcPos = getSrcPos(version);
+        if (srcPos.isObject())
+            version->profPos = &*profNames.insert(posToString(srcPos)).first;
+        else
+            version->profPos = &profFunName(version);
+    }
 
-        if (op == "get_field_list")
-        {
-            numTmps += 0;
+    return *version->profPos;
+}
 
-            writeCode(GET_FIELD_LIST);
-            continue;
-        }
+/**
+Record a profiler sample when entering a block version. The call stack
+is reconstructed from the saved frame links, which are consistent at
+block entries. The innermost source position is that of the sampled
+instruction, if it belongs to the same function as the current block.
+*/
+__attribute__((noinline)) void takeProfSample(uint8_t* entryAddr)
+{
+    auto sampleAddr = profSampleAddr;
+    profSampleAddr = nullptr;
 
-        if (op == "eq_obj")
-        {
-            numTmps -= 1;
-            writeCode(EQ_OBJ);
-            continue;
-        }
+    auto curVer = findVersion(entryAddr);
+    assert (curVer);
 
-        //
-        // Array operations
-        //
+    auto leafVer = findVersion(sampleAddr);
+    if (!leafVer || leafVer->fun != curVer->fun)
+        leafVer = curVer;
 
-        if (op == "new_array")
-        {
-            numTmps += 0;
-            writeCode(NEW_ARRAY);
-            continue;
-        }
+    // Function names, from the innermost function outwards
+    std::vector<std::string> names;
+    names.push_back(profFunName(curVer));
 
-        if (op == "array_len")
-        {
-            numTmps += 0;
-            writeCode(ARRAY_LEN);
-            continue;
-        }
+    static ICache numLocalsIC("num_locals");
+    auto version = curVer;
+    auto frame = framePtr;
 
-        if (op == "array_push")
-        {
-            numTmps -= 2;
-            writeCode(ARRAY_PUSH);
-            continue;
-        }
+    while (names.size() < PROF_MAX_DEPTH)
+    {
+        auto numLocals = numLocalsIC.getInt32(version->fun);
+        auto retVer = (BlockVersion*)frame[-(numLocals + 2)].getWord().ptr;
 
-        if (op == "array_pop")
-        {
-            numTmps += 0;
-            writeCode(ARRAY_POP);
-            continue;
-        }
+        // Stop at the frame of the outermost call into the interpreter
+        if (!retVer)
+            break;
 
-        if (op == "set_elem")
-        {
-            numTmps -= 3;
-            writeCode(SET_ELEM);
-            continue;
-        }
+        frame = (Value*)frame[-(numLocals + 1)].getWord().ptr;
+        version = retVer;
+        names.push_back(profFunName(version));
+    }
 
-        if (op == "get_elem")
-        {
-            numTmps -= 1;
-            writeCode(GET_ELEM);
-            continue;
-        }
+    profNumSamples++;
+    profSelf[names[0]]++;
+    profPositions[profPosName(leafVer)]++;
 
-        if (op == "eq_array")
-        {
-            numTmps -= 1;
-            writeCode(EQ_ARRAY);
-            continue;
-        }
+    // Recursive functions are only counted once per sample
+    std::unordered_set<std::string> seen;
+    std::string stack;
+    for (auto itr = names.rbegin(); itr != names.rend(); ++itr)
+    {
+        if (seen.insert(*itr).second)
+            profTotal[*itr]++;
 
-        //
-        // Branch instructions
-        //
+        if (stack.size() > 0)
+            stack += ";";
+        stack += *itr;
+    }
 
-        if (op == "jump")
-        {
-            numTmps += 0;
+    profStacks[stack]++;
+}
 
-            static ICache toIC("to");
-            auto dstBB = toIC.getObj(instr);
-            auto dstVer = getBlockVersion(version->fun, dstBB, numTmps);
+/// Start the profiling timer
+void startProfiler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROF_PERIOD_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
 
-            writeCode(JUMP_STUB);
-            writeCode(dstVer);
-            continue;
-        }
+/// Print the entries of a profile table with the most samples
+void printProfTable(
+    const char* title,
+    const std::unordered_map<std::string, uint64_t>& table
+)
+{
+    std::vector<std::pair<uint64_t, std::string>> entries;
+    for (auto& pair : table)
+        entries.push_back({ pair.second, pair.first });
+    std::sort(entries.rbegin(), entries.rend());
 
-        if (op == "if_true")
-        {
-            numTmps -= 1;
+    std::cout << title << std::endl;
 
-            static ICache thenIC("then");
-            static ICache elseIC("else");
-            auto thenBB = thenIC.getObj(instr);
-            auto elseBB = elseIC.getObj(instr);
-            auto thenVer = getBlockVersion(version->fun, thenBB, numTmps);
-            auto elseVer = getBlockVersion(version->fun, elseBB, numTmps);
+    for (size_t i = 0; i < entries.size() && i < 25; ++i)
+    {
+        printf(
+            "%10lu %6.2f%%  %s\n",
+            (unsigned long)entries[i].first,
+            100.0 * entries[i].first / profNumSamples,
+            entries[i].second.c_str()
+        );
+    }
+}
 
-            writeCode(IF_TRUE);
-            writeCode(thenVer);
-            writeCode(elseVer);
+/// Stop the profiler, print the flat profile and
+/// write the collapsed call stacks to the output file
+void printProfile()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
 
-            continue;
-        }
+    std::cout << "profile (" << profNumSamples << " samples, ";
+    std::cout << PROF_PERIOD_US << "us period)" << std::endl;
 
-        if (op == "call")
-        {
-            static ICache numArgsCache("num_args");
-            auto numArgs = (int16_t)numArgsCache.getInt32(instr);
-
-            genCall(
-                version,
-                instr,
-                numArgs,
-                numTmps
-            );
+    if (profNumSamples == 0)
+        return;
 
-            continue;
-        }
+    printProfTable("functions, self samples", profSelf);
+    printProfTable("functions, total samples", profTotal);
+    printProfTable("source positions, self samples", profPositions);
 
-        if (op == "ret")
-        {
-            numTmps -= 1;
+    std::ofstream out(profileOutFile);
+    if (!out)
+    {
+        std::cerr << "could not write profile to " << profileOutFile << std::endl;
+        return;
+    }
 
-            // TODO: should report source position (src_pos)
-            // of function if this check fails
-            if (numTmps != 0)
-            {
-                throw RunError(
-                    "there must be no values left on the temporary stack "
-                    "when returning from a function"
-                );
-            }
+    for (auto& pair : profStacks)
+        out << pair.first << " " << pair.second << "\n";
 
-            writeCode(RET);
-            continue;
-        }
+    std::cout << "collapsed stacks written to " << profileOutFile << std::endl;
+}
 
-        if (op == "throw")
-        {
-            numTmps -= 1;
+/// Allocations recorded at an allocation site. Counts are estimates
+/// when sampling, since each sample stands for the bytes allocated
+/// since the previous one.
+struct AllocSite
+{
+    double count = 0;
+    uint64_t bytes = 0;
+};
 
-            // Store a mapping of this instruction to the block version
-            // Needed to retrieve the identity of the current function
-            instrMap[codeHeapAlloc] = version;
+/// Allocation sites, identified by function, source position and tag
+typedef std::tuple<const std::string*, const std::string*, Tag> AllocSiteKey;
+std::map<AllocSiteKey, AllocSite> allocSites;
 
-            writeCode(THROW);
-            continue;
-        }
+/// Total number of bytes recorded by the allocation profiler
+uint64_t allocProfBytes = 0;
 
-        if (op == "import")
-        {
-            // Push the import function on the stack
-            numTmps += 1;
-            writeCode(PUSH);
-            writeCode((Word)(refptr)&importFn);
-            writeCode((Tag)TAG_HOSTFN);
-
-            // Call the import function
-            genCall(
-                version,
-                instr,
-                1,
-                numTmps
-            );
+/**
+Record an allocation in the allocation profile. The allocation site is
+the block version being executed, found from the instruction pointer.
+Allocations made outside of compiled code, such as when parsing images,
+are attributed to the runtime.
+*/
+void recordAlloc(size_t numBytes, Tag tag, size_t sampledBytes)
+{
+    static const std::string runtimeName = "<runtime>";
 
-            continue;
-        }
+    // Finding the source position can allocate strings
+    static bool recording = false;
+    if (recording)
+        return;
+    recording = true;
 
-        throw RunError("unhandled opcode in basic block \"" + op + "\"");
-    }
+    auto version = instrPtr? findVersion(instrPtr):nullptr;
+    auto funName = version? &profFunName(version):&runtimeName;
+    auto posName = version? &profPosName(version):&runtimeName;
 
-    // Mark the block end
-    version->endPtr = codeHeapAlloc;
+    auto& site = allocSites[AllocSiteKey(funName, posName, tag)];
+    site.count += double(sampledBytes) / numBytes;
+    site.bytes += sampledBytes;
+    allocProfBytes += sampledBytes;
 
-    //std::cout << "done compiling version" << std::endl;
-    //std::cout << codeHeapSize() << std::endl;
+    recording = false;
 }
 
-/// Get the source position for a given instruction, if available
-Value getSrcPos(uint8_t* instrPtr)
+/// Print the allocation sites with the most bytes or allocations
+void printAllocTable(
+    const char* title,
+    std::vector<std::pair<AllocSiteKey, AllocSite>> sites,
+    bool byCount
+)
 {
-    auto itr = instrMap.find(instrPtr);
-    if (itr == instrMap.end())
+    std::sort(
+        sites.begin(),
+        sites.end(),
+        [byCount](const std::pair<AllocSiteKey, AllocSite>& a,
+                  const std::pair<AllocSiteKey, AllocSite>& b)
+        {
+            if (byCount)
+                return a.second.count > b.second.count;
+            return a.second.bytes > b.second.bytes;
+        }
+    );
+
+    std::cout << title << std::endl;
+    std::cout << "       bytes       %      count  tag      site" << std::endl;
+
+    for (size_t i = 0; i < sites.size() && i < 25; ++i)
     {
-        std::cout << "no instr to block mapping" << std::endl;
-        return Value::UNDEF;
+        auto& key = sites[i].first;
+        auto& site = sites[i].second;
+
+        printf(
+            "%12lu %6.2f%% %10.0f  %-8s %s",
+            (unsigned long)site.bytes,
+            100.0 * site.bytes / allocProfBytes,
+            site.count,
+            heapTagToStr(std::get<2>(key)).c_str(),
+            std::get<1>(key)->c_str()
+        );
+
+        // Show the function unless the position is the function name
+        if (std::get<0>(key) != std::get<1>(key))
+            printf(" (%s)", std::get<0>(key)->c_str());
+        printf("\n");
     }
+}
 
-    auto block = itr->second->block;
+/// Print the allocation profile
+void printAllocProfile()
+{
+    vm.setAllocHook(nullptr, 0);
 
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
-    assert (instrs.length() > 0);
+    std::cout << "allocation profile (" << allocProfBytes << " bytes, ";
+    if (allocSampleBytes > 0)
+        std::cout << "sampled every " << allocSampleBytes << " bytes)" << std::endl;
+    else
+        std::cout << "all allocations)" << std::endl;
 
-    // Traverse the instructions in reverse
-    for (int i = (int)instrs.length() - 1; i >= 0; --i)
-    {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = Object(instrVal);
+    if (allocProfBytes == 0)
+        return;
 
-        if (instr.hasField("src_pos"))
-            return instr.getField("src_pos");
-    }
+    std::vector<std::pair<AllocSiteKey, AllocSite>> sites(
+        allocSites.begin(),
+        allocSites.end()
+    );
 
-    return Value::UNDEF;
+    printAllocTable("allocation sites, by bytes", sites, false);
+    printAllocTable("allocation sites, by count", sites, true);
 }
 
 /// Implementation of the throw instruction
@@ -1175,9 +3070,9 @@ void throwExc(
     //std::cout << "Entering throwExc" << std::endl;
 
     // Get the current function
-    auto itr = instrMap.find(throwInstr);
-    assert (itr != instrMap.end());
-    auto curFun = itr->second->fun;
+    auto curVersion = findVersion(throwInstr);
+    assert (curVersion);
+    auto curFun = curVersion->fun;
 
     // Until we are done unwinding the stack
     for (;;)
@@ -1237,31 +3132,31 @@ void throwExc(
             throw RunError(errMsg);
         }
 
-        // Find the info associated with the return address
-        assert (retAddrMap.find(retVer) != retAddrMap.end());
-        auto retEntry = retAddrMap[retVer];
+        // Find the info of the call returning to this address
+        auto callInfo = retVer->retCallInfo;
+        assert (callInfo);
 
         // Get the function associated with the return address
-        curFun = retEntry.retVer->fun;
+        curFun = retVer->fun;
 
         // If there is an exception handler
-        if (retEntry.excVer)
+        if (callInfo->excVer)
         {
             //std::cout << "Found exception handler" << std::endl;
-            //std::cout << "numTmps=" << retEntry.numTmps << std::endl;
+            //std::cout << "numTmps=" << callInfo->numTmps << std::endl;
             //std::cout << "frameSize()=" << frameSize() << std::endl;
 
             // Clear the temporary stack
-            stackPtr += retEntry.numTmps;
+            stackPtr += callInfo->numTmps;
 
             // Push the exception value on the stack
             pushVal(excVal);
 
             // Compile exception handler if needed
-            if (!retEntry.excVer->startPtr)
-                compile(retEntry.excVer);
+            if (!callInfo->excVer->startPtr)
+                compile(callInfo->excVer);
 
-            instrPtr = retEntry.excVer->startPtr;
+            instrPtr = callInfo->excVer->startPtr;
 
             // Done unwinding the stack
             break;
@@ -1296,23 +3191,82 @@ void checkArgCount(
 }
 
 /**
-Perform a user function call (call to user-implemented Zeta function)
+Raise an exception with a given error message at a call instruction,
+once the call arguments have been popped off the stack
 */
-__attribute__((always_inline)) inline void userCall(
+void throwFromCall(
+    uint8_t* callInstr,
+    BlockVersion* retVer,
+    std::string errMsg
+)
+{
+    // Create an exception object
+    auto excVal = Object::newObject();
+    auto errStr = String(errMsg);
+    excVal.setField("msg", errStr);
+
+    auto callInfo = retVer->retCallInfo;
+    assert (callInfo);
+
+    // If there is an exception handler (throw_to field)
+    if (callInfo->excVer)
+    {
+        // Clear the temporary stack
+        stackPtr += callInfo->numTmps;
+
+        // Push the exception value on the stack
+        pushVal(excVal);
+
+        // Compile exception handler if needed
+        if (!callInfo->excVer->startPtr)
+            compile(callInfo->excVer);
+
+        instrPtr = callInfo->excVer->startPtr;
+    }
+    else
+    {
+        // Unwind the interpreter stack
+        throwExc(callInstr, excVal);
+    }
+}
+
+/**
+Look up the entry information for a function which is not in the inline
+cache of a call site. The function is added to the cache if there is room,
+otherwise the call site is megamorphic and the global table is used.
+*/
+__attribute__((noinline)) FunEntry callCacheMiss(
     uint8_t* callInstr,
     Object fun,
     CallInfo& callInfo
 )
 {
-    size_t numArgs = callInfo.numArgs;
+    auto itr = funEntryMap.find((refptr)fun);
 
-    // If the function does not match the inline cache
-    if (callInfo.lastFn != (refptr)fun)
+    if (itr == funEntryMap.end())
     {
+        static ICache localsIC("num_locals");
+        auto nlocals = localsIC.getInt32(fun);
+        assert(nlocals >= 0);
+        auto numLocals = size_t(nlocals);
+
+        static ICache paramsIC("params");
+        auto params = paramsIC.getArr(fun);
+        auto numParams = size_t(params.length());
+
+        // Note: the hidden function/closure parameter is always present
+        if (numLocals < numParams + 1)
+        {
+            throw RunError(
+                "not enough locals to store function parameters"
+            );
+        }
+
         // Get a version for the function entry block
+        // Note: no types are known for the parameters and locals
         static ICache entryIC("entry");
         auto entryBB = entryIC.getObj(fun);
-        auto entryVer = getBlockVersion(fun, entryBB, 0);
+        auto entryVer = getBlockVersion(fun, entryBB, CodeGenCtx(numLocals, 0));
 
         if (!entryVer->startPtr)
         {
@@ -1320,36 +3274,86 @@ __attribute__((always_inline)) inline void userCall(
             compile(entryVer);
         }
 
-        static ICache localsIC("num_locals");
-        auto nlocals = localsIC.getInt32(fun);
-        assert(nlocals >= 0);
-        auto numLocals = size_t(nlocals);
+        FunEntry entry;
+        entry.fun = (refptr)fun;
+        entry.entryVer = entryVer;
+        entry.numLocals = numLocals;
+        entry.numParams = numParams;
+        itr = funEntryMap.insert({ (refptr)fun, entry }).first;
+    }
 
-        static ICache paramsIC("params");
-        auto params = paramsIC.getArr(fun);
-        auto numParams = size_t(params.length());
+    auto& entry = itr->second;
+
+    // Check that the argument count matches
+    checkArgCount(callInstr, entry.numParams, callInfo.numArgs);
+
+    if (callInfo.numEntries < CALL_CACHE_SIZE)
+    {
+        callCacheMisses++;
+        callInfo.cache[callInfo.numEntries++] = entry;
+    }
+    else
+    {
+        callMegaLookups++;
+    }
+
+    return entry;
+}
 
-        // Check that the argument count matches
-        checkArgCount(callInstr, numParams, numArgs);
+/**
+Perform a user function call (call to user-implemented Zeta function)
+*/
+__attribute__((always_inline)) inline void userCall(
+    uint8_t* callInstr,
+    Object fun,
+    CallInfo& callInfo
+)
+{
+    size_t numArgs = callInfo.numArgs;
 
-        // Note: the hidden function/closure parameter is always present
-        if (numLocals < numParams + 1)
+    // Look for the function in the inline cache
+    const FunEntry* entry = nullptr;
+    for (size_t i = 0; i < CALL_CACHE_SIZE; ++i)
+    {
+        if (callInfo.cache[i].fun == (refptr)fun)
         {
-            throw RunError(
-                "not enough locals to store function parameters"
-            );
+            entry = &callInfo.cache[i];
+            break;
         }
+    }
 
-        // Update the inline cache
-        callInfo.lastFn = (refptr)fun;
-        callInfo.numLocals = numLocals;
-        callInfo.entryVer = entryVer;
+    FunEntry missEntry;
+    if (entry)
+    {
+        callCacheHits++;
+    }
+    else
+    {
+        missEntry = callCacheMiss(callInstr, fun, callInfo);
+        entry = &missEntry;
     }
 
-    size_t numLocals = callInfo.numLocals;
-    BlockVersion* entryVer = callInfo.entryVer;
+    size_t numLocals = entry->numLocals;
+    BlockVersion* entryVer = entry->entryVer;
     BlockVersion* retVer = callInfo.retVer;
 
+    // Make sure there is space for the callee locals and the saved
+    // registers. A stack overflow is raised as an exception which
+    // the caller can catch.
+    if (size_t(stackPtr - stackLimit) < numLocals + 3)
+    {
+        try
+        {
+            growStack(numLocals + 3);
+        }
+        catch (RunError& err)
+        {
+            stackPtr += numArgs;
+            throwFromCall(callInstr, retVer, err.toString());
+            return;
+        }
+    }
+
     // Compute the stack pointer to restore after the call
     auto prevStackPtr = stackPtr + numArgs;
 
@@ -1366,6 +3370,10 @@ __attribute__((always_inline)) inline void userCall(
     // Pop the arguments, push the callee locals
     stackPtr -= numLocals - numArgs;
 
+    // Clear the locals, so the garbage collector only sees valid values
+    for (size_t i = numArgs + 1; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+
     pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
     pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
     pushVal(Value((refptr)retVer, TAG_RAWPTR));
@@ -1425,34 +3433,7 @@ __attribute__((always_inline)) inline void hostCall(
         // Pop the arguments from the stack
         stackPtr += numArgs;
 
-        // Create an exception object
-        auto excVal = Object::newObject();
-        auto errStr = String(err.toString());
-        excVal.setField("msg", errStr);
-
-        auto retEntry = retAddrMap[retVer];
-
-        // If there is an exception handler (throw_to field)
-        if (retEntry.excVer)
-        {
-            // Clear the temporary stack
-            stackPtr += retEntry.numTmps;
-
-            // Push the exception value on the stack
-            pushVal(excVal);
-
-            // Compile exception handler if needed
-            if (!retEntry.excVer->startPtr)
-                compile(retEntry.excVer);
-
-            instrPtr = retEntry.excVer->startPtr;
-        }
-        else
-        {
-            // Unwind the interpreter stack
-            throwExc(callInstr, excVal);
-        }
-
+        throwFromCall(callInstr, retVer, err.toString());
         return;
     }
 
@@ -1462,73 +3443,173 @@ __attribute__((always_inline)) inline void hostCall(
     // Push the return value
     pushVal(retVal);
 
+    // Host functions may allocate memory
+    gcSafepoint();
+
     if (!retVer->startPtr)
         compile(retVer);
 
     instrPtr = retVer->startPtr;
 }
 
-/// Start/continue execution beginning at a current instruction
-Value execCode()
+/**
+Implementation of conditional branch instructions. Reads the branch
+targets following the instruction, compiles the successor taken if
+needed, and patches its address into the instruction.
+*/
+__attribute__((always_inline)) inline void condBranch(bool cond)
+{
+    // Branch target addresses, null until patched
+    auto& thenAddr = readCode<uint8_t*>();
+    auto& elseAddr = readCode<uint8_t*>();
+    auto thenVer = readCode<BlockVersion*>();
+    auto elseVer = readCode<BlockVersion*>();
+
+    if (cond)
+    {
+        if (!thenAddr)
+        {
+            //std::cout << "Patching then target" << std::endl;
+
+            if (!thenVer->startPtr)
+               compile(thenVer);
+
+            // Patch the jump
+            thenAddr = thenVer->startPtr;
+            branchPatchCount++;
+        }
+
+        instrPtr = thenAddr;
+    }
+    else
+    {
+        if (!elseAddr)
+        {
+           //std::cout << "Patching else target" << std::endl;
+
+           if (!elseVer->startPtr)
+               compile(elseVer);
+
+           // Patch the jump
+           elseAddr = elseVer->startPtr;
+           branchPatchCount++;
+        }
+
+        instrPtr = elseAddr;
+    }
+}
+
+#ifdef THREADED_DISPATCH
+/// Each instruction handler is both a switch case and a label whose
+/// address is written into the code heap. Every handler ends with its
+/// own indirect jump to the next handler, which gives the branch
+/// predictor one jump site per opcode instead of a single shared one.
+///
+/// When counting instructions, the code heap holds the addresses of
+/// counting labels placed before the handlers instead, so that there
+/// is no cost to the handlers otherwise.
+#define INSTR(name) case name: if (false) { name##_CNT: opCounts[name]++; } name##_LBL
+#define NEXT_INSTR() goto *(opPtr = &readCode<OpVal>(), *opPtr)
+#else
+#define INSTR(name) case name
+#define NEXT_INSTR() break
+#endif
+
+/// Execute instructions beginning at the current instruction
+Value execInstrs()
 {
-    assert (instrPtr >= codeHeap);
-    assert (instrPtr < codeHeapLimit);
+    // Pointer to the opcode of the instruction being executed
+    OpVal* opPtr;
+
+#ifdef THREADED_DISPATCH
+    // On the first call, we only export the handler addresses,
+    // which compile() needs before any code can be executed
+    if (!opHandlers)
+    {
+        static const void* handlers[NUM_OPCODES] = {};
+        static const void* countHandlers[NUM_OPCODES] = {};
+        #define HANDLER(name)                   \
+            handlers[name] = &&name##_LBL;      \
+            countHandlers[name] = &&name##_CNT;
+        OPCODE_LIST(HANDLER)
+        #undef HANDLER
+
+        for (size_t i = 0; i < NUM_OPCODES; ++i)
+            assert (handlers[i] && "missing instruction handler");
+
+        opHandlers = execStatsEnabled? countHandlers:handlers;
+        return Value::UNDEF;
+    }
+#endif
+
+    assert (instrPtr != nullptr);
+
+#ifdef THREADED_DISPATCH
+    // Jump straight into the first handler. With threaded dispatch,
+    // the loop and switch below are only reached through the labels.
+    NEXT_INSTR();
+#endif
 
     // For each instruction to execute
     for (;;)
     {
-        auto& op = readCode<Opcode>();
+        opPtr = &readCode<OpVal>();
+
+#ifndef THREADED_DISPATCH
+        if (execStatsEnabled)
+            opCounts[*opPtr]++;
+#endif
 
         //std::cout << "instr" << std::endl;
         //std::cout << "op=" << (int)op << std::endl;
         //std::cout << "  stack space: " << (stackBase - stackPtr) << std::endl;
 
-        switch (op)
+        switch ((uintptr_t)*opPtr)
         {
-            case PUSH:
+            INSTR(PUSH):
             {
                 auto word = readCode<Word>();
                 auto tag = readCode<Tag>();
                 pushVal(Value(word, tag));
             }
-            break;
+            NEXT_INSTR();
 
-            case POP:
+            INSTR(POP):
             {
                 popVal();
             }
-            break;
+            NEXT_INSTR();
 
-            case DUP:
+            INSTR(DUP):
             {
                 // Read the index of the value to duplicate
                 auto idx = readCode<uint16_t>();
                 auto val = stackPtr[idx];
                 pushVal(val);
             }
-            break;
+            NEXT_INSTR();
 
             // Swap the topmost two stack elements
-            case SWAP:
+            INSTR(SWAP):
             {
                 auto v0 = popVal();
                 auto v1 = popVal();
                 pushVal(v0);
                 pushVal(v1);
             }
-            break;
+            NEXT_INSTR();
 
             // Set a local variable
-            case SET_LOCAL:
+            INSTR(SET_LOCAL):
             {
                 auto localIdx = readCode<uint16_t>();
                 //std::cout << "set localIdx=" << localIdx << std::endl;
                 assert (stackPtr > stackLimit);
                 framePtr[-localIdx] = popVal();
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_LOCAL:
+            INSTR(GET_LOCAL):
             {
                 // Read the index of the value to push
                 auto localIdx = readCode<uint16_t>();
@@ -1537,9 +3618,9 @@ Value execCode()
                 auto val = framePtr[-localIdx];
                 pushVal(val);
             }
-            break;
+            NEXT_INSTR();
 
-            case LOCAL_HAS_TAG:
+            INSTR(LOCAL_HAS_TAG):
             {
                 // Read the index of the local value
                 auto localIdx = readCode<uint16_t>();
@@ -1551,257 +3632,269 @@ Value execCode()
                 auto valTag = val.getTag();
                 pushBool(valTag == testTag);
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Integer operations
             //
-            case INC_I32:
+            INSTR(INC_I32):
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + 1));
             }
-            break;
-            case DEC_I32:
+            NEXT_INSTR();
+            INSTR(DEC_I32):
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - 1));
             }
-            break;
+            NEXT_INSTR();
 
-            case ADD_I32:
+            INSTR(ADD_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 + arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case SUB_I32:
+            INSTR(ADD_LOCALS_I32):
+            {
+                auto idx0 = readCode<uint16_t>();
+                auto idx1 = readCode<uint16_t>();
+                auto dstIdx = readCode<uint16_t>();
+                auto arg0 = framePtr[-idx0];
+                auto arg1 = framePtr[-idx1];
+                assert (arg0.isInt32() && arg1.isInt32());
+                framePtr[-dstIdx] = Value::int32((int32_t)arg0 + (int32_t)arg1);
+            }
+            NEXT_INSTR();
+
+            INSTR(SUB_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 - arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case MUL_I32:
+            INSTR(MUL_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 * arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case DIV_I32:
+            INSTR(DIV_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 / arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case MOD_I32:
+            INSTR(MOD_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 % arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case SHL_I32:
+            INSTR(SHL_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 << arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case SHR_I32:
+            INSTR(SHR_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 >> arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case USHR_I32:
+            INSTR(USHR_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = (uint32_t)popInt32();
                 pushVal(Value::int32((int32_t)(arg0 >> arg1)));
             }
-            break;
+            NEXT_INSTR();
 
-            case AND_I32:
+            INSTR(AND_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 & arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case OR_I32:
+            INSTR(OR_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 | arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case XOR_I32:
+            INSTR(XOR_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushVal(Value::int32(arg0 ^ arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case NOT_I32:
+            INSTR(NOT_I32):
             {
                 auto arg0 = popInt32();
                 pushVal(Value::int32(~arg0));
             }
-            break;
+            NEXT_INSTR();
 
-            case LT_I32:
+            INSTR(LT_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 < arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case LE_I32:
+            INSTR(LE_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 <= arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case GT_I32:
+            INSTR(GT_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 > arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case GE_I32:
+            INSTR(GE_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 >= arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case EQ_I32:
+            INSTR(EQ_I32):
             {
                 auto arg1 = popInt32();
                 auto arg0 = popInt32();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Floating-point operations
             //
 
-            case ADD_F32:
+            INSTR(ADD_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 + arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case SUB_F32:
+            INSTR(SUB_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 - arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case MUL_F32:
+            INSTR(MUL_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 * arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case DIV_F32:
+            INSTR(DIV_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushVal(Value::float32(arg0 / arg1));
             }
-            break;
+            NEXT_INSTR();
 
-            case LT_F32:
+            INSTR(LT_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 < arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case LE_F32:
+            INSTR(LE_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 <= arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case GT_F32:
+            INSTR(GT_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 > arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case GE_F32:
+            INSTR(GE_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 >= arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case EQ_F32:
+            INSTR(EQ_F32):
             {
                 auto arg1 = popFloat32();
                 auto arg0 = popFloat32();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
-            case SIN_F32:
+            INSTR(SIN_F32):
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sin(arg)));
             }
-            break;
+            NEXT_INSTR();
 
-            case COS_F32:
+            INSTR(COS_F32):
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(cos(arg)));
             }
-            break;
+            NEXT_INSTR();
 
-            case SQRT_F32:
+            INSTR(SQRT_F32):
             {
                 float arg = popFloat32();
                 pushVal(Value::float32(sqrt(arg)));
             }
-            break;
+            NEXT_INSTR();
 
-            case LOG_F32:
+            INSTR(LOG_F32):
             {
                 float arg = popFloat32();
 
@@ -1810,51 +3903,51 @@ Value execCode()
 
                 pushVal(Value::float32(log(arg)));
             }
-            break;
+            NEXT_INSTR();
 
-            case EXP_F32:
+            INSTR(EXP_F32):
             {
                 float arg = popFloat32();
                 auto r = exp(arg);
                 pushVal(Value::float32(r));
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Conversion operations
             //
 
-            case I32_TO_F32:
+            INSTR(I32_TO_F32):
             {
                 auto arg0 = popInt32();
                 pushVal(Value::float32(arg0));
             }
-            break;
+            NEXT_INSTR();
 
-            case I32_TO_STR:
+            INSTR(I32_TO_STR):
             {
                 auto arg0 = popInt32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            NEXT_INSTR();
 
-            case F32_TO_I32:
+            INSTR(F32_TO_I32):
             {
                 auto arg0 = popFloat32();
                 pushVal(Value::int32(arg0));
             }
-            break;
+            NEXT_INSTR();
 
-            case F32_TO_STR:
+            INSTR(F32_TO_STR):
             {
                 auto arg0 = popFloat32();
                 String str = std::to_string(arg0);
                 pushVal(str);
             }
-            break;
+            NEXT_INSTR();
 
-            case STR_TO_F32:
+            INSTR(STR_TO_F32):
             {
                 auto arg0 = popStr();
 
@@ -1872,51 +3965,53 @@ Value execCode()
 
                 pushVal(Value::float32(val));
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Misc operations
             //
 
-            case EQ_BOOL:
+            INSTR(EQ_BOOL):
             {
                 auto arg1 = popBool();
                 auto arg0 = popBool();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             // Test if a value has a given tag
-            case HAS_TAG:
+            INSTR(HAS_TAG):
             {
                 auto testTag = readCode<Tag>();
                 auto valTag = popVal().getTag();
                 pushBool(valTag == testTag);
             }
-            break;
+            NEXT_INSTR();
 
             // Get the type tag associated with a value.
             // Note: this produces a string
-            case GET_TAG:
+            INSTR(GET_TAG):
             {
                 auto valTag = popVal().getTag();
                 auto tagStr = tagToStr(valTag);
                 pushVal(String(tagStr));
             }
-            break;
+            NEXT_INSTR();
 
             //
             // String operations
             //
 
-            case STR_LEN:
+            // Ropes know their length without being flattened
+            INSTR(STR_LEN):
             {
-                auto str = popStr();
-                pushVal(Value::int32(str.length()));
+                auto str = popVal();
+                assert (str.isString());
+                pushVal(Value::int32(strLength(str)));
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_CHAR:
+            INSTR(GET_CHAR):
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1938,9 +4033,9 @@ Value execCode()
 
                 pushVal(charStrings[ch]);
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_CHAR_CODE:
+            INSTR(GET_CHAR_CODE):
             {
                 auto idx = (size_t)popInt32();
                 auto str = popStr();
@@ -1955,77 +4050,102 @@ Value execCode()
                 unsigned char ch = (unsigned char)str[idx];
                 pushVal(Value::int32(ch));
             }
-            break;
+            NEXT_INSTR();
 
-            case CHAR_TO_STR:
+            INSTR(CHAR_TO_STR):
             {
                 auto charCode = (char)popInt32();
                 char buf[2] = { (char)charCode, '\0' };
                 pushVal(String(buf));
             }
-            break;
+            NEXT_INSTR();
 
-            case STR_CAT:
+            INSTR(STR_CAT):
             {
-                auto a = popStr();
-                auto b = popStr();
-                auto c = String::concat(b, a);
-                pushVal(c);
+                gcSafepoint();
+                auto a = popVal();
+                auto b = popVal();
+                assert (a.isString() && b.isString());
+                pushVal(Rope::concat(b, a));
             }
-            break;
+            NEXT_INSTR();
 
-            case EQ_STR:
+            INSTR(EQ_STR):
             {
                 auto arg1 = popStr();
                 auto arg0 = popStr();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Object operations
             //
 
-            case NEW_OBJECT:
+            INSTR(NEW_OBJECT):
             {
+                gcSafepoint();
                 auto capacity = popInt32();
                 auto obj = Object::newObject(capacity);
                 pushVal(obj);
             }
-            break;
+            NEXT_INSTR();
 
-            case HAS_FIELD:
+            INSTR(HAS_FIELD):
             {
                 auto fieldName = popStr();
                 auto obj = popObj();
-                pushBool(obj.hasField(fieldName));
+                auto& cache = readCode<FieldCache>();
+                pushBool(obj.hasField(fieldName, cache));
             }
-            break;
+            NEXT_INSTR();
+
+            INSTR(HAS_FIELD_IMM):
+            {
+                refptr nameStrPtr = readCode<refptr>();
+                String fieldName = Value(nameStrPtr, TAG_STRING);
+                auto obj = popObj();
+                auto& cache = readCode<FieldCache>();
+                pushBool(obj.hasField(fieldName, cache));
+            }
+            NEXT_INSTR();
 
-            case SET_FIELD:
+            INSTR(SET_FIELD):
             {
                 auto val = popVal();
                 auto fieldName = popStr();
                 auto obj = popObj();
-                obj.setField(fieldName, val);
+                auto& cache = readCode<FieldCache>();
+                obj.setField(fieldName, val, cache);
             }
-            break;
+            NEXT_INSTR();
+
+            // The assigned value is left on the stack
+            INSTR(SET_FIELD_IMM):
+            {
+                refptr nameStrPtr = readCode<refptr>();
+                String fieldName = Value(nameStrPtr, TAG_STRING);
+                auto obj = popObj();
+                auto& cache = readCode<FieldCache>();
+                obj.setField(fieldName, stackPtr[0], cache);
+            }
+            NEXT_INSTR();
 
             // This instruction will abort execution if trying to
             // access a field that is not present on an object.
             // The running program is responsible for testing that
             // fields exist before attempting to read them.
-            case GET_FIELD:
+            INSTR(GET_FIELD):
             {
                 auto fieldName = popStr();
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                // Get the inline cache
+                auto& cache = readCode<FieldCache>();
 
                 Value val;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, cache))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -2035,21 +4155,21 @@ Value execCode()
 
                 pushVal(val);
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_FIELD_IMM:
+            INSTR(GET_FIELD_IMM):
             {
                 refptr nameStrPtr = readCode<refptr>();
                 String fieldName = Value(nameStrPtr, TAG_STRING);
 
                 auto obj = popObj();
 
-                // Get the cached slot index
-                auto& slotIdx = readCode<size_t>();
+                // Get the inline cache
+                auto& cache = readCode<FieldCache>();
 
                 Value val;
 
-                if (!obj.getField(fieldName, val, slotIdx))
+                if (!obj.getField(fieldName, val, cache))
                 {
                     throw RunError(
                         "get_field failed, missing field \"" +
@@ -2059,9 +4179,9 @@ Value execCode()
 
                 pushVal(val);
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_FIELD_LIST:
+            INSTR(GET_FIELD_LIST):
             {
                 Value arg0 = popVal();
                 Array array = Array(0);
@@ -2072,54 +4192,56 @@ Value execCode()
                 }
                 pushVal(array);
             }
-            break;
+            NEXT_INSTR();
 
-            case EQ_OBJ:
+            INSTR(EQ_OBJ):
             {
                 Value arg1 = popVal();
                 Value arg0 = popVal();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Array operations
             //
 
-            case NEW_ARRAY:
+            INSTR(NEW_ARRAY):
             {
+                gcSafepoint();
+
                 // Note: capacity refers to preallocated slots,
                 // the new array will have length 0
                 auto capacity = popInt32();
                 auto array = Array(capacity);
                 pushVal(array);
             }
-            break;
+            NEXT_INSTR();
 
-            case ARRAY_LEN:
+            INSTR(ARRAY_LEN):
             {
                 auto arr = Array(popVal());
                 pushVal(Value::int32(arr.length()));
             }
-            break;
+            NEXT_INSTR();
 
-            case ARRAY_PUSH:
+            INSTR(ARRAY_PUSH):
             {
                 auto val = popVal();
                 auto arr = Array(popVal());
                 arr.push(val);
             }
-            break;
+            NEXT_INSTR();
 
-            case ARRAY_POP:
+            INSTR(ARRAY_POP):
             {
                 auto arr = Array(popVal());
                 auto val = arr.pop();
                 pushVal(val);
             }
-            break;
+            NEXT_INSTR();
 
-            case SET_ELEM:
+            INSTR(SET_ELEM):
             {
                 auto val = popVal();
                 auto idx = (size_t)popInt32();
@@ -2134,9 +4256,9 @@ Value execCode()
 
                 arr.setElem(idx, val);
             }
-            break;
+            NEXT_INSTR();
 
-            case GET_ELEM:
+            INSTR(GET_ELEM):
             {
                 auto idx = (size_t)popInt32();
                 auto arr = Array(popVal());
@@ -2150,21 +4272,40 @@ Value execCode()
 
                 pushVal(arr.getElem(idx));
             }
-            break;
+            NEXT_INSTR();
+
+            INSTR(GET_ELEM_LOCAL):
+            {
+                auto localIdx = readCode<uint16_t>();
+                auto idxVal = framePtr[-localIdx];
+                assert (idxVal.isInt32());
+                auto idx = (size_t)(int32_t)idxVal;
+                auto arr = Array(popVal());
+
+                if (idx >= arr.length())
+                {
+                    throw RunError(
+                        "get_elem, index out of bounds"
+                    );
+                }
+
+                pushVal(arr.getElem(idx));
+            }
+            NEXT_INSTR();
 
-            case EQ_ARRAY:
+            INSTR(EQ_ARRAY):
             {
                 Value arg1 = popVal();
                 Value arg0 = popVal();
                 pushBool(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             //
             // Branch instructions
             //
 
-            case JUMP_STUB:
+            INSTR(JUMP_STUB):
             {
                 auto& dstAddr = readCode<uint8_t*>();
 
@@ -2180,74 +4321,84 @@ Value execCode()
                     {
                         // The jump is redundant, so we will write the
                         // next block over this jump instruction
-                        instrPtr = codeHeapAlloc = (uint8_t*)&op;
+                        codeHeapAlloc = (uint8_t*)opPtr;
                     }
 
                     compile(dstVer);
                 }
-                else
+
+                // If the block was not written over this jump, which
+                // happens when it was compiled in a new code segment
+                if (dstVer->startPtr != (uint8_t*)opPtr)
                 {
                     // Patch the jump
-                    op = JUMP;
+                    *opPtr = encodeOp(JUMP);
                     dstAddr = dstVer->startPtr;
-
-                    // Jump to the target
-                    instrPtr = dstVer->startPtr;
                 }
+
+                jumpPatchCount++;
+
+                // Jump to the target
+                instrPtr = dstVer->startPtr;
             }
-            break;
+            NEXT_INSTR();
 
-            case JUMP:
+            INSTR(JUMP):
             {
                 auto& dstAddr = readCode<uint8_t*>();
                 instrPtr = dstAddr;
             }
-            break;
+            NEXT_INSTR();
 
-            case IF_TRUE:
+            INSTR(IF_TRUE):
             {
-                auto& thenAddr = readCode<uint8_t*>();
-                auto& elseAddr = readCode<uint8_t*>();
-
                 auto arg0 = popVal();
+                condBranch(arg0 == Value::TRUE);
+            }
+            NEXT_INSTR();
 
-                if (arg0 == Value::TRUE)
-                {
-                    if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
-                    {
-                        //std::cout << "Patching then target" << std::endl;
-
-                        auto thenVer = (BlockVersion*)thenAddr;
-                        if (!thenVer->startPtr)
-                           compile(thenVer);
-
-                        // Patch the jump
-                        thenAddr = thenVer->startPtr;
-                    }
+            INSTR(IF_LT_I32):
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                condBranch(arg0 < arg1);
+            }
+            NEXT_INSTR();
 
-                    instrPtr = thenAddr;
-                }
-                else
-                {
-                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
-                    {
-                       //std::cout << "Patching else target" << std::endl;
+            INSTR(IF_LE_I32):
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                condBranch(arg0 <= arg1);
+            }
+            NEXT_INSTR();
 
-                       auto elseVer = (BlockVersion*)elseAddr;
-                       if (!elseVer->startPtr)
-                           compile(elseVer);
+            INSTR(IF_GT_I32):
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                condBranch(arg0 > arg1);
+            }
+            NEXT_INSTR();
 
-                       // Patch the jump
-                       elseAddr = elseVer->startPtr;
-                    }
+            INSTR(IF_GE_I32):
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                condBranch(arg0 >= arg1);
+            }
+            NEXT_INSTR();
 
-                    instrPtr = elseAddr;
-                }
+            INSTR(IF_EQ_I32):
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                condBranch(arg0 == arg1);
             }
-            break;
+            NEXT_INSTR();
 
             // Regular function call
-            case CALL:
+            INSTR(CALL):
             {
                 auto& callInfo = readCode<CallInfo>();
 
@@ -2263,7 +4414,7 @@ Value execCode()
                 if (callee.isObject())
                 {
                     userCall(
-                        (uint8_t*)&op,
+                        (uint8_t*)opPtr,
                         callee,
                         callInfo
                     );
@@ -2271,7 +4422,7 @@ Value execCode()
                 else if (callee.isHostFn())
                 {
                     hostCall(
-                        (uint8_t*)&op,
+                        (uint8_t*)opPtr,
                         callee,
                         callInfo.numArgs,
                         callInfo.retVer
@@ -2282,9 +4433,9 @@ Value execCode()
                   throw RunError("invalid callee at call site");
                 }
             }
-            break;
+            NEXT_INSTR();
 
-            case RET:
+            INSTR(RET):
             {
                 // TODO: figure out callee identity from version,
                 // caller identity from return address
@@ -2329,16 +4480,60 @@ Value execCode()
                     instrPtr = retVer->startPtr;
                 }
             }
-            break;
+            NEXT_INSTR();
 
             // Throw an exception
-            case THROW:
+            INSTR(THROW):
             {
                 // Pop the exception value
                 auto excVal = popVal();
-                throwExc((uint8_t*)&op, excVal);
+                throwExc((uint8_t*)opPtr, excVal);
             }
-            break;
+            NEXT_INSTR();
+
+            // Count entries into a block version, and compile
+            // the block to native code once it becomes hot
+            INSTR(COUNT_ENTRY):
+            {
+                auto& counter = readCode<EntryCounter>();
+
+                if (++counter.count == JIT_THRESHOLD)
+                {
+                    auto nativeFn = jitCompile(instrPtr);
+
+                    if (nativeFn)
+                    {
+                        counter.nativeFn = nativeFn;
+                        *opPtr = encodeOp(NATIVE_ENTRY);
+                        nativeFn();
+                    }
+                }
+            }
+            NEXT_INSTR();
+
+            // Count entries into a block version, for profiling
+            INSTR(PROFILE_ENTRY):
+            {
+                auto version = readCode<BlockVersion*>();
+                version->entryCount++;
+            }
+            NEXT_INSTR();
+
+            INSTR(PROFILE_SAMPLE):
+            {
+                if (profSampleAddr)
+                    takeProfSample((uint8_t*)opPtr);
+            }
+            NEXT_INSTR();
+
+            // Run the native code for a block version. This sets
+            // the instruction pointer to where execution resumes.
+            INSTR(NATIVE_ENTRY):
+            {
+                auto& counter = readCode<EntryCounter>();
+                counter.nativeFn();
+            }
+            NEXT_INSTR();
 
             default:
             assert (false && "unhandled instruction in interpreter loop");
@@ -2349,6 +4544,35 @@ Value execCode()
     assert (false);
 }
 
+#undef INSTR
+#undef NEXT_INSTR
+
+/**
+Start/continue execution beginning at a current instruction. A stack
+overflow when pushing a value is raised as an exception thrown by the
+function being executed, and execution resumes in the handler found by
+unwinding the stack.
+*/
+Value execCode()
+{
+    for (;;)
+    {
+        try
+        {
+            return execInstrs();
+        }
+        catch (StackOverflow& err)
+        {
+            auto excVal = Object::newObject();
+            excVal.setField("msg", String(err.toString()));
+
+            // The instruction pointer is past the opcode
+            // of the instruction which overflowed the stack
+            throwExc(instrPtr - 1, excVal);
+        }
+    }
+}
+
 /**
 Call into a user function from an outside context
 Note: this may be indirectly called from within a running interpreter
@@ -2375,6 +4599,10 @@ Value callFun(Object fun, ValueVec args)
         );
     }
 
+    // Make sure there is space for the locals and the saved registers
+    if (size_t(stackPtr - stackLimit) < numLocals + 3)
+        growStack(numLocals + 3);
+
     // Store the stack size before the call
     auto preCallSz = stackSize();
 
@@ -2392,6 +4620,10 @@ Value callFun(Object fun, ValueVec args)
     stackPtr -= numLocals;
     assert (stackPtr >= stackLimit);
 
+    // Clear the locals, so the garbage collector only sees valid values
+    for (size_t i = 0; i < numLocals; ++i)
+        framePtr[-i] = Value::UNDEF;
+
     // Push the previous stack pointer, previous
     // frame pointer and return address
     pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
@@ -2411,7 +4643,7 @@ Value callFun(Object fun, ValueVec args)
     // Get the function entry block
     static ICache entryIC("entry");
     auto entryBlock = entryIC.getObj(fun);
-    auto entryVer = getBlockVersion(fun, entryBlock, 0);
+    auto entryVer = getBlockVersion(fun, entryBlock, CodeGenCtx(numLocals, 0));
 
     // Generate code for the entry block version
     compile(entryVer);
@@ -2480,4 +4712,7 @@ void testInterp()
     assert (testRunImage("tests/vm/ex_rec_fact.zim") == Value::int32(5040));
     assert (testRunImage("tests/vm/ex_fibonacci.zim") == Value::int32(377));
     assert (testRunImage("tests/vm/float_ops.zim").toString() == "10.500000");
+    assert (testRunImage("tests/vm/type_tests.zim") == Value::int32(13));
+    assert (testRunImage("tests/vm/superinstrs.zim") == Value::int32(0));
+    assert (testRunImage("tests/vm/field_caches.zim") == Value::int32(0));
 }
@@ -1,10 +1,80 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include "runtime.h"
 
 typedef std::vector<Value> ValueVec;
 
+/// Enable the baseline JIT compiler (set before initInterp)
+extern bool jitEnabled;
+
+/// Enable the profiling of executed block instruction pairs
+/// (set before initInterp)
+extern bool opPairsEnabled;
+
+/// Enable the counting of executed instructions (set before initInterp)
+extern bool execStatsEnabled;
+
+/// Enable the sampling profiler, and file it writes collapsed
+/// call stacks to (set before initInterp)
+extern bool profileEnabled;
+extern std::string profileOutFile;
+
+/// Enable the allocation profiler, and number of bytes allocated
+/// between samples, zero to record every allocation
+/// (set before initInterp)
+extern bool allocProfEnabled;
+extern size_t allocSampleBytes;
+
+/// Initial code heap size and maximum code heap size, in bytes
+/// (set before initInterp)
+extern size_t codeHeapInitSize;
+extern size_t codeHeapMaxSize;
+
+/// Initial stack size and maximum stack size, in bytes
+/// (set before initInterp)
+extern size_t stackInitSize;
+extern size_t stackMaxSize;
+
+/// Compute the amount of code allocated in the code heap, in bytes
+size_t codeHeapSize();
+
+/// Number of block versions compiled, and time spent compiling them
+extern uint64_t compileCount;
+extern uint64_t compileTimeNs;
+
+/// Call site inline cache statistics: calls which hit a cache entry,
+/// calls which added a cache entry, and megamorphic lookups
+extern uint64_t callCacheHits;
+extern uint64_t callCacheMisses;
+extern uint64_t callMegaLookups;
+
+/// Number of jump stubs and conditional branch targets patched
+extern uint64_t jumpPatchCount;
+extern uint64_t branchPatchCount;
+
+/// Get the execution counts of the opcodes executed so far, by name.
+/// Instructions are only counted when execStatsEnabled is set.
+std::vector<std::pair<std::string, uint64_t>> getOpCounts();
+
+/// Print the instruction counts, along with code patching and
+/// inline cache statistics
+void printExecStats();
+
+/// Print the most frequently executed block instruction pairs
+void printOpPairs();
+
+/// Stop the sampling profiler and report the samples taken
+void printProfile();
+
+/// Print the allocation sites with the most bytes and allocations
+void printAllocProfile();
+
+/// Perform a garbage collection of the heap. Collections are minor
+/// in generational mode, unless a full collection is requested.
+void gcCollect(bool full);
+
 /// Initialize the interpreter
 void initInterp();
 
@@ -0,0 +1,485 @@
+#include <cassert>
+#include <cstring>
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+/// The native code relies on the 16-byte tagged value layout,
+/// with the word at offset 0 and the tag at offset 8
+const int32_t VAL_SIZE = 16;
+const int32_t TAG_OFS = 8;
+
+/// x86-64 register numbers
+const uint8_t RAX = 0;
+const uint8_t RCX = 1;
+const uint8_t RDX = 2;
+const uint8_t RSI = 6;
+const uint8_t RDI = 7;
+
+/// Condition codes for setcc (second opcode byte)
+const uint8_t SETL  = 0x9C;
+const uint8_t SETLE = 0x9E;
+const uint8_t SETG  = 0x9F;
+const uint8_t SETGE = 0x9D;
+const uint8_t SETE  = 0x94;
+
+/// Executable memory region
+uint8_t* jitRegion = nullptr;
+
+/// Limit pointer for the executable memory region
+uint8_t* jitRegionLimit = nullptr;
+
+/// Current allocation pointer in the executable memory region
+uint8_t* jitRegionAlloc = nullptr;
+
+bool jitSupported()
+{
+#ifdef JIT_X86_64
+    return sizeof(Value) == VAL_SIZE;
+#else
+    return false;
+#endif
+}
+
+void initJIT(size_t regionSize)
+{
+    assert (jitSupported());
+    assert (jitRegion == nullptr);
+
+#ifdef JIT_X86_64
+    auto mem = mmap(
+        nullptr,
+        regionSize,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (mem == MAP_FAILED)
+    {
+        throw RunError("failed to allocate executable memory for the JIT");
+    }
+
+    jitRegion = (uint8_t*)mem;
+    jitRegionLimit = jitRegion + regionSize;
+    jitRegionAlloc = jitRegion;
+#endif
+}
+
+size_t jitCodeSize()
+{
+    return jitRegionAlloc - jitRegion;
+}
+
+NativeBlock::NativeBlock(
+    Value** stackPtrAddr,
+    Value** framePtrAddr,
+    Value** stackLimitAddr,
+    uint8_t** instrPtrAddr
+)
+: stackPtrAddr(stackPtrAddr),
+  framePtrAddr(framePtrAddr),
+  stackLimitAddr(stackLimitAddr),
+  instrPtrAddr(instrPtrAddr)
+{
+}
+
+void NativeBlock::emit8(uint8_t byte)
+{
+    code.push_back(byte);
+}
+
+void NativeBlock::emit32(int32_t val)
+{
+    for (size_t i = 0; i < 4; ++i)
+        emit8((uint8_t)(val >> (8 * i)));
+}
+
+void NativeBlock::emit64(int64_t val)
+{
+    for (size_t i = 0; i < 8; ++i)
+        emit8((uint8_t)(val >> (8 * i)));
+}
+
+void NativeBlock::patch32(size_t ofs, int32_t val)
+{
+    assert (ofs + 4 <= code.size());
+    for (size_t i = 0; i < 4; ++i)
+        code[ofs + i] = (uint8_t)(val >> (8 * i));
+}
+
+/// mov reg64, [base + disp32]
+void NativeBlock::loadWord(uint8_t reg, uint8_t base, int32_t disp)
+{
+    emit8(0x48);
+    emit8(0x8B);
+    emit8(0x80 | (reg << 3) | base);
+    emit32(disp);
+}
+
+/// mov [base + disp32], reg64
+void NativeBlock::storeWord(uint8_t reg, uint8_t base, int32_t disp)
+{
+    emit8(0x48);
+    emit8(0x89);
+    emit8(0x80 | (reg << 3) | base);
+    emit32(disp);
+}
+
+/// Grow (positive) or shrink (negative) the stack by some number of values
+/// Note: this clobbers the flags register
+void NativeBlock::adjustStack(int32_t numVals)
+{
+    if (numVals == 0)
+        return;
+
+    // sub rsi, imm32 / add rsi, imm32
+    emit8(0x48);
+    emit8(0x81);
+    emit8(numVals > 0? 0xEE:0xC6);
+    emit32((numVals > 0? numVals:-numVals) * VAL_SIZE);
+
+    curDepth += numVals;
+    if (curDepth > maxDepth)
+        maxDepth = curDepth;
+}
+
+/// Push a value held in a pair of registers
+void NativeBlock::pushPair(uint8_t wordReg, uint8_t tagReg)
+{
+    adjustStack(1);
+    storeWord(wordReg, RSI, 0);
+    storeWord(tagReg, RSI, TAG_OFS);
+}
+
+/// Exit to the interpreter before the current instruction
+/// if the tag at a given address doesn't match
+void NativeBlock::guardTag(uint8_t base, int32_t disp, Tag tag)
+{
+    // cmp byte [base + disp32], imm8
+    emit8(0x80);
+    emit8(0x80 | (7 << 3) | base);
+    emit32(disp);
+    emit8(tag);
+
+    // jne rel32
+    emit8(0x0F);
+    emit8(0x85);
+    exits.push_back({ code.size(), curInstr });
+    emit32(0);
+}
+
+/// Convert the flags into a boolean stored on top of the stack,
+/// after growing or shrinking the stack by some number of values
+void NativeBlock::storeFlag(uint8_t setcc, int32_t numVals)
+{
+    // setcc al
+    emit8(0x0F);
+    emit8(setcc);
+    emit8(0xC0);
+
+    // movzx eax, al
+    emit8(0x0F);
+    emit8(0xB6);
+    emit8(0xC0);
+
+    adjustStack(numVals);
+    storeWord(RAX, RSI, 0);
+
+    // mov byte [rsi + TAG_OFS], TAG_BOOL
+    emit8(0xC6);
+    emit8(0x80 | RSI);
+    emit32(TAG_OFS);
+    emit8(TAG_BOOL);
+}
+
+/// Write back the stack pointer and resume interpretation at an address
+void NativeBlock::emitExit(uint8_t* resumeAddr)
+{
+    // mov [r8], rsi
+    emit8(0x49);
+    emit8(0x89);
+    emit8(0x30);
+
+    // mov rax, imm64
+    emit8(0x48);
+    emit8(0xB8);
+    emit64((int64_t)resumeAddr);
+
+    // mov [r9], rax
+    emit8(0x49);
+    emit8(0x89);
+    emit8(0x01);
+
+    // ret
+    emit8(0xC3);
+}
+
+void NativeBlock::beginInstr(uint8_t* interpAddr)
+{
+    curInstr = interpAddr;
+
+    if (numInstrs++ > 0)
+        return;
+
+    // The prologue is generated along with the first instruction
+
+    // mov r8, stackPtrAddr
+    emit8(0x49);
+    emit8(0xB8);
+    emit64((int64_t)stackPtrAddr);
+
+    // mov r9, instrPtrAddr
+    emit8(0x49);
+    emit8(0xB9);
+    emit64((int64_t)instrPtrAddr);
+
+    // mov rsi, [r8]
+    emit8(0x49);
+    emit8(0x8B);
+    emit8(0x30);
+
+    // mov rdi, framePtrAddr
+    // mov rdi, [rdi]
+    emit8(0x48);
+    emit8(0xBF);
+    emit64((int64_t)framePtrAddr);
+    emit8(0x48);
+    emit8(0x8B);
+    emit8(0x3F);
+
+    // mov rax, stackLimitAddr
+    // mov rax, [rax]
+    emit8(0x48);
+    emit8(0xB8);
+    emit64((int64_t)stackLimitAddr);
+    emit8(0x48);
+    emit8(0x8B);
+    emit8(0x00);
+
+    // Check that there is enough stack space for the whole block,
+    // otherwise let the interpreter handle the stack overflow
+    // lea rdx, [rsi - maxDepth * VAL_SIZE]
+    emit8(0x48);
+    emit8(0x8D);
+    emit8(0x96);
+    depthDispOfs = code.size();
+    emit32(0);
+
+    // cmp rdx, rax
+    emit8(0x48);
+    emit8(0x39);
+    emit8(0xC2);
+
+    // jbe rel32
+    emit8(0x0F);
+    emit8(0x86);
+    exits.push_back({ code.size(), curInstr });
+    emit32(0);
+}
+
+void NativeBlock::push(Word word, Tag tag)
+{
+    adjustStack(1);
+
+    // mov rax, imm64
+    emit8(0x48);
+    emit8(0xB8);
+    emit64(word.int64);
+    storeWord(RAX, RSI, 0);
+
+    // mov byte [rsi + TAG_OFS], imm8
+    emit8(0xC6);
+    emit8(0x80 | RSI);
+    emit32(TAG_OFS);
+    emit8(tag);
+}
+
+void NativeBlock::pop()
+{
+    adjustStack(-1);
+}
+
+void NativeBlock::dup(uint16_t idx)
+{
+    loadWord(RAX, RSI, idx * VAL_SIZE);
+    loadWord(RDX, RSI, idx * VAL_SIZE + TAG_OFS);
+    pushPair(RAX, RDX);
+}
+
+void NativeBlock::swap()
+{
+    loadWord(RAX, RSI, 0);
+    loadWord(RCX, RSI, VAL_SIZE);
+    storeWord(RCX, RSI, 0);
+    storeWord(RAX, RSI, VAL_SIZE);
+
+    loadWord(RAX, RSI, TAG_OFS);
+    loadWord(RCX, RSI, VAL_SIZE + TAG_OFS);
+    storeWord(RCX, RSI, TAG_OFS);
+    storeWord(RAX, RSI, VAL_SIZE + TAG_OFS);
+}
+
+void NativeBlock::getLocal(uint16_t idx)
+{
+    loadWord(RAX, RDI, -idx * VAL_SIZE);
+    loadWord(RDX, RDI, -idx * VAL_SIZE + TAG_OFS);
+    pushPair(RAX, RDX);
+}
+
+void NativeBlock::setLocal(uint16_t idx)
+{
+    loadWord(RAX, RSI, 0);
+    loadWord(RDX, RSI, TAG_OFS);
+    adjustStack(-1);
+    storeWord(RAX, RDI, -idx * VAL_SIZE);
+    storeWord(RDX, RDI, -idx * VAL_SIZE + TAG_OFS);
+}
+
+void NativeBlock::localHasTag(uint16_t idx, Tag tag)
+{
+    // cmp byte [rdi + disp32], imm8
+    emit8(0x80);
+    emit8(0x80 | (7 << 3) | RDI);
+    emit32(-idx * VAL_SIZE + TAG_OFS);
+    emit8(tag);
+
+    storeFlag(SETE, 1);
+}
+
+void NativeBlock::guardLocalTag(uint16_t idx, Tag tag)
+{
+    guardTag(RDI, -idx * VAL_SIZE + TAG_OFS, tag);
+}
+
+void NativeBlock::hasTag(Tag tag)
+{
+    // cmp byte [rsi + TAG_OFS], imm8
+    emit8(0x80);
+    emit8(0x80 | (7 << 3) | RSI);
+    emit32(TAG_OFS);
+    emit8(tag);
+
+    storeFlag(SETE, 0);
+}
+
+void NativeBlock::intOp(NativeIntOp op)
+{
+    guardTag(RSI, TAG_OFS, TAG_INT32);
+    guardTag(RSI, VAL_SIZE + TAG_OFS, TAG_INT32);
+
+    // mov eax, [rsi + VAL_SIZE]
+    emit8(0x8B);
+    emit8(0x80 | (RAX << 3) | RSI);
+    emit32(VAL_SIZE);
+
+    // op eax, [rsi]
+    switch (op)
+    {
+        case NATIVE_ADD: emit8(0x03); break;
+        case NATIVE_SUB: emit8(0x2B); break;
+        case NATIVE_AND: emit8(0x23); break;
+        case NATIVE_OR:  emit8(0x0B); break;
+        case NATIVE_XOR: emit8(0x33); break;
+        case NATIVE_MUL: emit8(0x0F); emit8(0xAF); break;
+        default: assert (false);
+    }
+    emit8(0x80 | (RAX << 3) | RSI);
+    emit32(0);
+
+    // int32 values are stored sign-extended to 64 bits
+    // movsxd rax, eax
+    emit8(0x48);
+    emit8(0x63);
+    emit8(0xC0);
+
+    // The result goes in the slot of the first operand,
+    // which is already tagged as int32
+    adjustStack(-1);
+    storeWord(RAX, RSI, 0);
+}
+
+void NativeBlock::intCmp(NativeCmpOp op)
+{
+    guardTag(RSI, TAG_OFS, TAG_INT32);
+    guardTag(RSI, VAL_SIZE + TAG_OFS, TAG_INT32);
+
+    // mov eax, [rsi + VAL_SIZE]
+    emit8(0x8B);
+    emit8(0x80 | (RAX << 3) | RSI);
+    emit32(VAL_SIZE);
+
+    // cmp eax, [rsi]
+    emit8(0x3B);
+    emit8(0x80 | (RAX << 3) | RSI);
+    emit32(0);
+
+    uint8_t setcc;
+    switch (op)
+    {
+        case NATIVE_LT: setcc = SETL; break;
+        case NATIVE_LE: setcc = SETLE; break;
+        case NATIVE_GT: setcc = SETG; break;
+        case NATIVE_GE: setcc = SETGE; break;
+        case NATIVE_EQ: setcc = SETE; break;
+        default: assert (false); setcc = SETE;
+    }
+
+    storeFlag(setcc, -1);
+}
+
+void NativeBlock::intAddImm(int32_t val)
+{
+    guardTag(RSI, TAG_OFS, TAG_INT32);
+
+    // mov eax, [rsi]
+    emit8(0x8B);
+    emit8(0x80 | (RAX << 3) | RSI);
+    emit32(0);
+
+    // add eax, imm32
+    emit8(0x05);
+    emit32(val);
+
+    // movsxd rax, eax
+    emit8(0x48);
+    emit8(0x63);
+    emit8(0xC0);
+
+    storeWord(RAX, RSI, 0);
+}
+
+NativeFn NativeBlock::finish(uint8_t* resumeAddr)
+{
+    assert (numInstrs > 0);
+
+    // Patch the stack space check in the prologue
+    patch32(depthDispOfs, (int32_t)(-maxDepth * VAL_SIZE));
+
+    // Exit at the end of the block
+    emitExit(resumeAddr);
+
+    // Generate the guard exits out of line
+    for (auto& exit : exits)
+    {
+        auto jumpOfs = exit.first;
+        patch32(jumpOfs, (int32_t)(code.size() - (jumpOfs + 4)));
+        emitExit(exit.second);
+    }
+
+    // If the executable memory region is full
+    if (jitRegionAlloc + code.size() > jitRegionLimit)
+    {
+        return nullptr;
+    }
+
+    auto fnPtr = jitRegionAlloc;
+    memcpy(fnPtr, code.data(), code.size());
+    jitRegionAlloc += code.size();
+
+    return (NativeFn)fnPtr;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "runtime.h"
+
+/**
+Natively compiled code fragment. This runs a sequence of interpreter
+instructions directly on the interpreter stack, then stores the address
+of the first instruction it did not execute into the instruction pointer
+and returns to the interpreter loop.
+*/
+typedef void (*NativeFn)();
+
+/// Integer operations supported by the native code generator
+enum NativeIntOp
+{
+    NATIVE_ADD,
+    NATIVE_SUB,
+    NATIVE_MUL,
+    NATIVE_AND,
+    NATIVE_OR,
+    NATIVE_XOR
+};
+
+/// Integer comparisons supported by the native code generator
+enum NativeCmpOp
+{
+    NATIVE_LT,
+    NATIVE_LE,
+    NATIVE_GT,
+    NATIVE_GE,
+    NATIVE_EQ
+};
+
+/// Check if native code generation is supported on this platform
+bool jitSupported();
+
+/// Allocate the executable memory region for native code
+void initJIT(size_t regionSize);
+
+/// Get the amount of native code generated so far, in bytes
+size_t jitCodeSize();
+
+/**
+Native code generator for a straight-line sequence of interpreter
+instructions. Type checks are compiled into guards which exit back
+to the interpreter before the failing instruction is executed.
+*/
+class NativeBlock
+{
+private:
+
+    /// Addresses of the interpreter registers
+    Value** stackPtrAddr;
+    Value** framePtrAddr;
+    Value** stackLimitAddr;
+    uint8_t** instrPtrAddr;
+
+    /// Machine code being generated
+    std::vector<uint8_t> code;
+
+    /// Guard exits to generate, as (jump offset, resume address) pairs
+    std::vector<std::pair<size_t, uint8_t*>> exits;
+
+    /// Offset of the stack depth displacement in the prologue
+    size_t depthDispOfs;
+
+    /// Interpreter address of the current instruction
+    uint8_t* curInstr = nullptr;
+
+    /// Number of instructions compiled
+    size_t numInstrs = 0;
+
+    /// Current and maximum number of values pushed by the block
+    int64_t curDepth = 0;
+    int64_t maxDepth = 0;
+
+    void emit8(uint8_t byte);
+    void emit32(int32_t val);
+    void emit64(int64_t val);
+    void patch32(size_t ofs, int32_t val);
+
+    void loadWord(uint8_t reg, uint8_t base, int32_t disp);
+    void storeWord(uint8_t reg, uint8_t base, int32_t disp);
+    void adjustStack(int32_t numVals);
+    void pushPair(uint8_t wordReg, uint8_t tagReg);
+    void guardTag(uint8_t base, int32_t disp, Tag tag);
+    void storeFlag(uint8_t setcc, int32_t numVals);
+    void emitExit(uint8_t* resumeAddr);
+
+public:
+
+    NativeBlock(
+        Value** stackPtrAddr,
+        Value** framePtrAddr,
+        Value** stackLimitAddr,
+        uint8_t** instrPtrAddr
+    );
+
+    /// Begin compiling the instruction at a given interpreter address
+    void beginInstr(uint8_t* interpAddr);
+
+    /// Number of instructions compiled so far
+    size_t length() const { return numInstrs; }
+
+    void push(Word word, Tag tag);
+    void pop();
+    void dup(uint16_t idx);
+    void swap();
+    void getLocal(uint16_t idx);
+    void setLocal(uint16_t idx);
+    void localHasTag(uint16_t idx, Tag tag);
+    void guardLocalTag(uint16_t idx, Tag tag);
+    void hasTag(Tag tag);
+    void intOp(NativeIntOp op);
+    void intCmp(NativeCmpOp op);
+    void intAddImm(int32_t val);
+
+    /// Finish the block, resuming interpretation at a given address.
+    /// Returns nullptr if the executable memory region is full.
+    NativeFn finish(uint8_t* resumeAddr);
+};
@@ -1,28 +1,28 @@
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <exception>
 #include "parser.h"
 #include "interp.h"
 #include "packages.h"
 #include "opt_parser.h"
+#include "jit.h"
 
-int runPkgMain(
+/// Call a function exported by a package with the program arguments
+Value callPkgFn(
     Object pkg,
+    std::string fnName,
     std::string pkgName,
     std::vector<std::string> progArgs
 )
 {
-    // If the package has no main function, do nothing
-    if (!pkg.hasField("main"))
-        return 0;
-
-    auto mainFn = pkg.getFieldObj("main");
-    auto params = mainFn.getFieldArr("params");
-
-    Value retVal;
+    auto fn = pkg.getFieldObj(fnName);
+    auto params = fn.getFieldArr("params");
 
-    // If the main function expects an arguments array
+    // If the function expects an arguments array
     if (params.length() == 1)
     {
         // Create an array to store the program arguments
@@ -31,28 +31,41 @@ int runPkgMain(
         for (size_t i = 0; i < progArgs.size(); ++i)
             argVals.push(String(progArgs[i]));
 
-        // Call main with an array of string arguments
-        retVal = callExportFn(pkg, "main", { argVals });
+        // Call the function with an array of string arguments
+        return callExportFn(pkg, fnName, { argVals });
     }
     else if (params.length() == 0)
     {
         if (progArgs.size() > 0)
         {
             throw RunError(
-                "main function expects zero arguments, "
+                fnName + " function expects zero arguments, "
                 "but some were provided"
             );
         }
 
-        // Call main with no arguments
-        retVal = callExportFn(pkg, "main");
+        // Call the function with no arguments
+        return callExportFn(pkg, fnName);
     }
     else
     {
         throw RunError(
-            "main function should either accept 0 or 1 parameter"
+            fnName + " function should either accept 0 or 1 parameter"
         );
     }
+}
+
+int runPkgMain(
+    Object pkg,
+    std::string pkgName,
+    std::vector<std::string> progArgs
+)
+{
+    // If the package has no main function, do nothing
+    if (!pkg.hasField("main"))
+        return 0;
+
+    auto retVal = callPkgFn(pkg, "main", pkgName, progArgs);
 
     if (!retVal.isInt32())
     {
@@ -64,13 +77,186 @@ int runPkgMain(
     return (int32_t)retVal;
 }
 
+/// Quote a string for JSON output
+std::string jsonStr(std::string str)
+{
+    std::string out = "\"";
+
+    for (auto ch : str)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            out += '\\';
+            out += ch;
+        }
+        else if ((unsigned char)ch < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out += buf;
+        }
+        else
+        {
+            out += ch;
+        }
+    }
+
+    return out + "\"";
+}
+
+/**
+Time repeated calls to the bench function of a package, or to its main
+function if it has none. Packages which do all their work when they are
+initialized get their init function called again. The package is only
+imported once, so the times exclude process startup and package loading.
+The results are printed as JSON, on the last line of the output.
+*/
+int runBench(
+    Object pkg,
+    std::string pkgName,
+    std::vector<std::string> progArgs,
+    size_t numIters,
+    size_t numWarmup
+)
+{
+    std::string fnName;
+    for (auto name : { "bench", "main", "init" })
+    {
+        if (pkg.hasField(name))
+        {
+            fnName = name;
+            break;
+        }
+    }
+
+    if (fnName == "")
+        throw RunError("package has no bench, main or init function to time");
+
+    if (numIters == 0)
+        throw RunError("the number of benchmark iterations must be nonzero");
+
+    for (size_t i = 0; i < numWarmup; ++i)
+        callPkgFn(pkg, fnName, pkgName, progArgs);
+
+    auto allocBefore = vm.allocated();
+    auto gcCountBefore = vm.getGCCount();
+    auto compileCountBefore = compileCount;
+    auto codeSizeBefore = codeHeapSize();
+
+    std::vector<double> times;
+
+    for (size_t i = 0; i < numIters; ++i)
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        callPkgFn(pkg, fnName, pkgName, progArgs);
+        auto endTime = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double, std::milli> time = endTime - startTime;
+        times.push_back(time.count());
+    }
+
+    auto sorted = times;
+    std::sort(sorted.begin(), sorted.end());
+    auto n = sorted.size();
+
+    // Nearest-rank percentiles
+    auto median = sorted[(n - 1) / 2];
+    auto p95 = sorted[(size_t)std::ceil(0.95 * n) - 1];
+
+    std::string timesStr;
+    for (auto time : times)
+        timesStr += (timesStr.size()? ", ":"") + std::to_string(time);
+
+    // The code heap shrinks when code gets collected
+    auto codeSize = codeHeapSize();
+    auto codeDelta = int64_t(codeSize) - int64_t(codeSizeBefore);
+
+    std::cout << "{";
+    std::cout << "\"package\": " << jsonStr(pkgName) << ", ";
+    std::cout << "\"function\": " << jsonStr(fnName) << ", ";
+    std::cout << "\"warmup\": " << numWarmup << ", ";
+    std::cout << "\"iters\": " << numIters << ", ";
+    std::cout << "\"times_ms\": [" << timesStr << "], ";
+    std::cout << "\"min_ms\": " << std::to_string(sorted[0]) << ", ";
+    std::cout << "\"median_ms\": " << std::to_string(median) << ", ";
+    std::cout << "\"p95_ms\": " << std::to_string(p95) << ", ";
+    std::cout << "\"alloc_bytes\": " << vm.allocated() - allocBefore << ", ";
+    std::cout << "\"gc_count\": " << vm.getGCCount() - gcCountBefore << ", ";
+    std::cout << "\"compile_count\": " << compileCount - compileCountBefore << ", ";
+    std::cout << "\"code_heap_bytes\": " << codeDelta;
+    std::cout << "}" << std::endl;
+
+    return 0;
+}
+
+/// Import a package, or load and initialize it from a local file
+Object loadPkg(std::string pkgName)
+{
+    try
+    {
+        return import(pkgName);
+    }
+
+    // If the package failed to import
+    catch (ImportError e)
+    {
+        // Try loading the package as a local file
+        auto pkg = load(pkgName);
+
+        // Keep the package alive during garbage collections
+        pkgCache[pkgName] = pkg;
+
+        // Initialize the package
+        if (pkg.hasField("init"))
+            callExportFn(pkg, "init");
+
+        return pkg;
+    }
+}
+
 int main(int argc, char** argv)
 {
     BoolOpt test('t', "test", false, "runs unit tests");
     BoolOpt help('h', "help", false, "prints this help message.");
+    BoolOpt jit("jit", false, "compiles hot code to native machine code (x86-64 Linux only).");
+    BoolOpt dumpOpPairs("dump-op-pairs", false, "prints the most frequently executed instruction pairs on exit.");
+    BoolOpt execStats("exec-stats", false, "counts the instructions executed and prints execution statistics on exit.");
+    BoolOpt bench("bench", false, "times repeated calls to the bench or main function of a package, and prints the results as JSON.");
+    UintOpt benchIters("iters", 10, "number of timed calls in benchmark mode.");
+    UintOpt benchWarmup("warmup", 2, "number of untimed warmup calls in benchmark mode.");
+    BoolOpt profile("profile", false, "samples the running program and prints a profile of its functions on exit.");
+    StrOpt profileOut("profile-out", profileOutFile, "file the profiler writes collapsed call stacks to, for flame graph tools.");
+    BoolOpt allocProfile("alloc-profile", false, "records the source positions of heap allocations and prints the top allocation sites on exit.");
+    UintOpt allocSample("alloc-sample", 0, "number of bytes allocated between allocation profile samples, 0 to record every allocation.");
+    UintOpt codeHeapInit("code-heap-init", codeHeapInitSize / 1024, "initial code heap size, in KiB.");
+    UintOpt codeHeapMax("code-heap-max", codeHeapMaxSize / 1024, "maximum code heap size, in KiB.");
+    UintOpt stackInit("stack-init", stackInitSize / 1024, "initial stack size, in KiB.");
+    UintOpt stackMax("stack-max", stackMaxSize / 1024, "maximum stack size, in KiB.");
+    UintOpt gcMin("gc-min", VM::DEFAULT_GC_MIN_BYTES / 1024, "minimum amount of memory allocated between garbage collections, in KiB.");
+    BoolOpt genGC("gen-gc", false, "enables generational garbage collection.");
+    UintOpt gcThreads("gc-threads", 1, "number of threads used to mark live objects during garbage collection.");
+    UintOpt gcNursery("gc-nursery", VM::DEFAULT_NURSERY_BYTES / 1024, "nursery size for generational garbage collection, in KiB.");
     OptParser parser;
     parser.add(test);
     parser.add(help);
+    parser.add(jit);
+    parser.add(dumpOpPairs);
+    parser.add(execStats);
+    parser.add(bench);
+    parser.add(benchIters);
+    parser.add(benchWarmup);
+    parser.add(profile);
+    parser.add(profileOut);
+    parser.add(allocProfile);
+    parser.add(allocSample);
+    parser.add(codeHeapInit);
+    parser.add(codeHeapMax);
+    parser.add(stackInit);
+    parser.add(stackMax);
+    parser.add(gcMin);
+    parser.add(genGC);
+    parser.add(gcNursery);
+    parser.add(gcThreads);
 
     try
     {
@@ -83,6 +269,49 @@ int main(int argc, char** argv)
             return 0;
         }
 
+        if (jit())
+        {
+            if (jitSupported())
+                jitEnabled = true;
+            else
+                std::cerr << "JIT not supported on this platform, ignoring --jit" << std::endl;
+        }
+
+        if (dumpOpPairs())
+        {
+            opPairsEnabled = true;
+            atexit(printOpPairs);
+        }
+
+        if (execStats())
+        {
+            execStatsEnabled = true;
+            atexit(printExecStats);
+        }
+
+        if (profile())
+        {
+            profileEnabled = true;
+            profileOutFile = profileOut.get();
+            atexit(printProfile);
+        }
+
+        if (allocProfile())
+        {
+            allocProfEnabled = true;
+            allocSampleBytes = allocSample.get();
+            atexit(printAllocProfile);
+        }
+
+        codeHeapInitSize = codeHeapInit.get() * 1024;
+        codeHeapMaxSize = codeHeapMax.get() * 1024;
+        stackInitSize = stackInit.get() * 1024;
+        stackMaxSize = stackMax.get() * 1024;
+        vm.setGCMinBytes(gcMin.get() * 1024);
+        if (genGC())
+            vm.enableGenGC(gcNursery.get() * 1024);
+        vm.setMarkThreads(gcThreads.get());
+
         initInterp();
 
         // If we are in test mode
@@ -96,26 +325,20 @@ int main(int argc, char** argv)
         }
 
         auto pkgName = parser.getProgramName();
+        auto pkg = loadPkg(pkgName);
 
-        // Try importing and running the package
-        try
+        if (bench())
         {
-            auto pkg = import(pkgName);
-            return runPkgMain(pkg, pkgName, parser.getProgramArgs());
+            return runBench(
+                pkg,
+                pkgName,
+                parser.getProgramArgs(),
+                benchIters.get(),
+                benchWarmup.get()
+            );
         }
 
-        // If the package failed to import
-        catch (ImportError e)
-        {
-            // Try loading the package as a local file
-            auto pkg = load(pkgName);
-
-            // Initialize the package
-            if (pkg.hasField("init"))
-                callExportFn(pkg, "init");
-
-            return runPkgMain(pkg, pkgName, parser.getProgramArgs());
-        }
+        return runPkgMain(pkg, pkgName, parser.getProgramArgs());
     }
 
     catch (ParseException& e)
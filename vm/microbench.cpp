@@ -0,0 +1,263 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "runtime.h"
+#include "parser.h"
+#include "serialize.h"
+#include "interp.h"
+
+/**
+Microbenchmarks of the runtime primitives. Each benchmark times a loop
+performing a number of operations on data prepared beforehand, and
+reports the time and the heap memory allocated per operation. The heap
+objects created here are not rooted, so garbage is only collected after
+a group of benchmarks, once the data it uses is no longer needed.
+*/
+
+/// Only the benchmarks whose name contains this string are run
+std::string benchFilter;
+
+/// Sink for benchmark results, so that the work is not optimized away
+volatile uint64_t benchSink;
+
+/// Run a benchmark performing a given number of operations
+template <typename Fn> void bench(std::string name, size_t numOps, Fn fn)
+{
+    if (name.find(benchFilter) == std::string::npos)
+        return;
+
+    auto allocBefore = vm.allocated();
+    auto startTime = std::chrono::steady_clock::now();
+
+    fn(numOps);
+
+    auto endTime = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> time = endTime - startTime;
+
+    printf(
+        "%-40s %12.1f %12.1f\n",
+        name.c_str(),
+        time.count() / numOps,
+        double(vm.allocated() - allocBefore) / numOps
+    );
+    fflush(stdout);
+}
+
+/// Create the field names f0, f1, ... of synthetic objects
+std::vector<String> fieldNames(size_t numFields)
+{
+    std::vector<String> names;
+    for (size_t i = 0; i < numFields; ++i)
+        names.push_back(String("f" + std::to_string(i)));
+    return names;
+}
+
+/// Create an object with a given number of fields
+Object newObject(std::vector<String>& names)
+{
+    auto obj = Object::newObject();
+    for (size_t i = 0; i < names.size(); ++i)
+        obj.setField(names[i], Value::int32(i));
+    return obj;
+}
+
+/// Create a graph of objects and arrays, with shared references
+Array newGraph(size_t numNodes)
+{
+    auto nodes = Array(numNodes);
+
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        auto node = Object::newObject();
+        node.setField("id", Value::int32(i));
+        node.setField("name", String("node" + std::to_string(i % 100)));
+
+        auto edges = Array(2);
+        if (i > 0)
+            edges.push(nodes.getElem(i / 2));
+        if (i > 1)
+            edges.push(nodes.getElem(i - 1));
+        node.setField("edges", edges);
+
+        nodes.push(node);
+    }
+
+    return nodes;
+}
+
+void benchAlloc()
+{
+    bench("vm alloc 32 bytes", 1000000, [](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (uint64_t)vm.alloc(32, TAG_ARRAY).getWord().ptr;
+    });
+
+    bench("vm alloc 256 bytes", 200000, [](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (uint64_t)vm.alloc(256, TAG_ARRAY).getWord().ptr;
+    });
+
+    gcCollect(true);
+}
+
+void benchObjects()
+{
+    // 128 fields is past the point where objects switch to dictionary mode
+    for (size_t numFields : { 1, 8, 32, 64, 128 })
+    {
+        auto suffix = " (" + std::to_string(numFields) + " fields)";
+        auto names = fieldNames(numFields);
+
+        bench("object setField, adding" + suffix, 200000, [&](size_t n) {
+            for (size_t i = 0; i < n; i += numFields)
+                benchSink += (uint64_t)(refptr)newObject(names);
+        });
+
+        auto obj = newObject(names);
+
+        bench("object setField, existing" + suffix, 1000000, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                obj.setField(names[i % numFields], Value::int32(i));
+        });
+
+        bench("object getField" + suffix, 1000000, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                benchSink += (int32_t)obj.getField(names[i % numFields]);
+        });
+
+        // A cache per field, as for instructions accessing a constant field
+        std::vector<FieldCache> caches(numFields);
+        bench("object getField, cached" + suffix, 1000000, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+            {
+                Value val;
+                obj.getField(names[i % numFields], val, caches[i % numFields]);
+                benchSink += (int32_t)val;
+            }
+        });
+
+        gcCollect(true);
+    }
+}
+
+void benchArrays()
+{
+    bench("array push", 1000000, [](size_t n) {
+        auto arr = Array(0);
+        for (size_t i = 0; i < n; ++i)
+            arr.push(Value::int32(i));
+        benchSink += arr.length();
+    });
+
+    auto arr = Array(0);
+    for (size_t i = 0; i < 1000; ++i)
+        arr.push(Value::int32(i));
+
+    bench("array getElem", 1000000, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (int32_t)arr.getElem(i % 1000);
+    });
+
+    gcCollect(true);
+}
+
+void benchStrings()
+{
+    std::vector<std::string> strs;
+    for (size_t i = 0; i < 1000; ++i)
+        strs.push_back("string number " + std::to_string(i));
+
+    // Keep the strings interned, so that lookups find them in the pool
+    std::vector<String> live;
+    for (auto& str : strs)
+        live.push_back(stringPool.getString(str));
+
+    bench("stringPool getString, existing", 1000000, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (uint64_t)(refptr)stringPool.getString(strs[i % strs.size()]);
+    });
+
+    bench("stringPool getString, new", 200000, [&](size_t n) {
+        std::string str = "new string ";
+        for (size_t i = 0; i < n; ++i)
+        {
+            str.resize(11);
+            str += std::to_string(i);
+            benchSink += (uint64_t)(refptr)stringPool.getString(str);
+        }
+    });
+
+    auto a = String("foo");
+    auto b = String("bar");
+    bench("string concat, short", 1000000, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (uint64_t)(refptr)String::concat(a, b);
+    });
+
+    bench("string concat, building 100 KB", 12500, [](size_t n) {
+        Value str = String("");
+        auto piece = String("abcdefgh");
+        for (size_t i = 0; i < n; ++i)
+            str = Rope::concat(str, piece);
+        benchSink += String(str).length();
+    });
+
+    gcCollect(true);
+}
+
+void benchImages()
+{
+    // Synthetic image with a mix of objects, arrays, strings and numbers
+    std::string image = "[\n";
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        image += "  { id: " + std::to_string(i) + ", name: \"item" + std::to_string(i) + "\", ";
+        image += "pos: [" + std::to_string(i) + ", 2.5f, -3], ok: $true },\n";
+    }
+    image += "];\n";
+
+    bench("parseString, 1000 objects", 100, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += (uint64_t)(refptr)parseString(image, "microbench");
+    });
+
+    auto graph = newGraph(1000);
+
+    bench("serialize, 1000 node graph", 20, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            benchSink += serialize(graph, false).size();
+    });
+
+    gcCollect(true);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        benchFilter = argv[1];
+
+    try
+    {
+        initInterp();
+
+        printf("%-40s %12s %12s\n", "benchmark", "ns/op", "bytes/op");
+
+        benchAlloc();
+        benchObjects();
+        benchArrays();
+        benchStrings();
+        benchImages();
+    }
+
+    catch (RunError& e)
+    {
+        std::cout << "ERROR: " << e.toString() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
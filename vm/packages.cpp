@@ -123,7 +123,7 @@ namespace core_vm_0
     */
     Value get_gc_count()
     {
-        assert (false && "implement me");
+        return Value::int32((int32_t)vm.getGCCount());
     }
 
     /**
@@ -131,10 +131,66 @@ namespace core_vm_0
     */
     Value gc_collect()
     {
-        assert (false && "implement me");
+        gcCollect(true);
         return Value::UNDEF;
     }
 
+    /// Convert a count into a value, as a float32 if it exceeds int32
+    Value countVal(uint64_t count)
+    {
+        if (count <= INT32_MAX)
+            return Value::int32((int32_t)count);
+        return Value::float32((float)count);
+    }
+
+    /**
+    Get the call site inline cache hit and miss counts, for tuning.
+    Megamorphic lookups are calls at sites whose cache is full.
+    */
+    Value get_call_stats()
+    {
+        auto obj = Object::newObject();
+        obj.setField("hits", countVal(callCacheHits));
+        obj.setField("misses", countVal(callCacheMisses));
+        obj.setField("mega_lookups", countVal(callMegaLookups));
+        return obj;
+    }
+
+    /**
+    Get the number of block versions compiled and the time spent compiling
+    */
+    Value get_compile_stats()
+    {
+        auto obj = Object::newObject();
+        obj.setField("count", countVal(compileCount));
+        obj.setField("time_ms", Value::float32(compileTimeNs / 1e6f));
+        return obj;
+    }
+
+    /**
+    Get the interpreter execution statistics: instruction counts by
+    opcode name, code patching counts and inline cache hit counts.
+    Instructions are only counted when running with --exec-stats.
+    */
+    Value get_stats()
+    {
+        auto opCounts = Object::newObject();
+        for (auto& count : getOpCounts())
+            opCounts.setField(count.first, countVal(count.second));
+
+        auto obj = Object::newObject();
+        obj.setField("op_counts", opCounts);
+        obj.setField("compile_count", countVal(compileCount));
+        obj.setField("jump_patches", countVal(jumpPatchCount));
+        obj.setField("branch_patches", countVal(branchPatchCount));
+        obj.setField("field_cache_hits", countVal(fieldCacheHits));
+        obj.setField("field_cache_misses", countVal(fieldCacheMisses));
+        obj.setField("call_cache_hits", countVal(callCacheHits));
+        obj.setField("call_cache_misses", countVal(callCacheMisses));
+        obj.setField("call_mega_lookups", countVal(callMegaLookups));
+        return obj;
+    }
+
     Value get_pkg()
     {
         auto exports = Object::newObject(32);
@@ -144,6 +200,9 @@ namespace core_vm_0
         setHostFn(exports, "serialize"    , 2, (void*)serialize);
         setHostFn(exports, "get_gc_count" , 0, (void*)get_gc_count);
         setHostFn(exports, "gc_collect"   , 0, (void*)gc_collect);
+        setHostFn(exports, "get_call_stats", 0, (void*)get_call_stats);
+        setHostFn(exports, "get_compile_stats", 0, (void*)get_compile_stats);
+        setHostFn(exports, "get_stats"    , 0, (void*)get_stats);
         return exports;
     }
 };
@@ -71,6 +71,9 @@ public:
 /// User-facing import function, used to implement the import instruction
 extern HostFn importFn;
 
+/// Cache of loaded packages, indexed by package name
+extern std::unordered_map<std::string, Value> pkgCache;
+
 /// Load a package based on its path
 Object load(std::string pkgPath);
 
@@ -2,6 +2,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "runtime.h"
 
 /// Undefined value constant
@@ -23,10 +28,14 @@ VM vm;
 // Global string pool
 StringPool stringPool;
 
+// Field cache statistics
+uint64_t fieldCacheHits = 0;
+uint64_t fieldCacheMisses = 0;
+
 /// Produce a string representation of a value
 std::string Value::toString() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_UNDEF:
         return "$undef";
@@ -35,10 +44,10 @@ std::string Value::toString() const
         return (*this == Value::TRUE)? "$true":"$false";
 
         case TAG_INT32:
-        return std::to_string(word.int32);
+        return std::to_string((int32_t)*this);
 
         case TAG_FLOAT32:
-        return std::to_string(word.float32);
+        return std::to_string((float)*this);
 
         case TAG_STRING:
         return (std::string)*this;
@@ -57,7 +66,7 @@ std::string Value::toString() const
 /// Determine if this value is of a pointer type
 bool Value::isPointer() const
 {
-    switch (tag)
+    switch (getTag())
     {
         case TAG_STRING:
         case TAG_ARRAY:
@@ -76,28 +85,731 @@ Value::operator std::string () const
     return String(*this);
 }
 
+/// Header tag of free memory blocks in heap chunks.
+/// This is not the tag of any value type.
+const Tag TAG_FREE = 0xFF;
+
+/// Header tag of ropes, which are string values
+const Tag TAG_ROPE = 0xFE;
+
+/// Get the size in bytes of a chunk object from its header
+static size_t headerSize(obj_header header)
+{
+    return ((header >> HEADER_IDX_SIZE) & HEADER_MAX_SIZE) * sizeof(Word);
+}
+
+/// Format a range of chunk memory as free blocks, so that
+/// the garbage collector can walk over it
+static void formatFree(refptr ptr, size_t numBytes)
+{
+    while (numBytes > 0)
+    {
+        auto blockSize = std::min(numBytes, HEADER_MAX_SIZE * sizeof(Word));
+        auto numWords = obj_header(blockSize / sizeof(Word));
+        *(obj_header*)ptr = TAG_FREE | (numWords << HEADER_IDX_SIZE);
+        ptr += blockSize;
+        numBytes -= blockSize;
+    }
+}
+
 VM::VM()
+: gcTriggerBytes(DEFAULT_GC_MIN_BYTES),
+  gcMinBytes(DEFAULT_GC_MIN_BYTES),
+  nurseryBytes(DEFAULT_NURSERY_BYTES),
+  fullTriggerBytes(DEFAULT_GC_MIN_BYTES)
+{
+}
+
+refptr VM::allocSlow(size_t numBytes)
+{
+    refptr ptr;
+
+    if (numBytes > MAX_CHUNK_ALLOC)
+    {
+        ptr = (refptr)calloc(1, numBytes);
+        if (!ptr)
+            throw RunError("failed to allocate heap object");
+        largeObjs.push_back({ ptr, numBytes });
+    }
+    else
+    {
+        retireRegion();
+
+        // Reuse the free memory found by the last collection
+        while (holeIdx < holes.size() && !allocPtr)
+        {
+            auto hole = holes[holeIdx++];
+            if (hole.second < numBytes)
+                continue;
+
+            memset(hole.first, 0, hole.second);
+            allocPtr = hole.first;
+            allocLimit = hole.first + hole.second;
+        }
+
+        // Otherwise, start allocating in a new chunk
+        if (!allocPtr)
+        {
+            auto chunk = (refptr)calloc(1, CHUNK_SIZE);
+            if (!chunk)
+                throw RunError("failed to allocate heap chunk");
+            chunks.push_back(chunk);
+
+            allocPtr = chunk;
+            allocLimit = chunk + CHUNK_SIZE;
+        }
+
+        youngRegions.push_back({ allocPtr, allocLimit });
+
+        ptr = allocPtr;
+        allocPtr += numBytes;
+    }
+
+    bytesAllocated += numBytes;
+    return ptr;
+}
+
+void VM::retireRegion()
+{
+    if (allocPtr < allocLimit)
+        formatFree(allocPtr, allocLimit - allocPtr);
+
+    allocPtr = nullptr;
+    allocLimit = nullptr;
+}
+
+size_t VM::allocated() const
+{
+    return bytesAllocated;
+}
+
+void VM::setGCMinBytes(size_t numBytes)
+{
+    gcMinBytes = numBytes;
+    fullTriggerBytes = std::max(gcMinBytes, 2 * liveBytes);
+    gcTriggerBytes = bytesAllocated + std::max(gcMinBytes, liveBytes);
+}
+
+void VM::enableGenGC(size_t numBytes)
+{
+    assert (gcCount == 0);
+    genEnabled = true;
+    nurseryBytes = numBytes;
+    gcTriggerBytes = bytesAllocated + nurseryBytes;
+}
+
+void VM::setMarkThreads(size_t numThreads)
+{
+    markThreads = std::max(numThreads, size_t(1));
+}
+
+void VM::setAllocHook(AllocHook hook, size_t sampleBytes)
+{
+    allocHook = hook;
+    allocSampleBytes = sampleBytes;
+    allocSampleLast = bytesAllocated;
+    allocSampleNext = hook? (bytesAllocated + sampleBytes):SIZE_MAX;
+}
+
+void VM::sampleAlloc(size_t numBytes, Tag tag)
+{
+    // The sample stands for all the bytes allocated since the last one
+    auto sampledBytes = bytesAllocated - allocSampleLast;
+    allocSampleLast = bytesAllocated;
+    allocSampleNext = bytesAllocated;
+
+    // Draw the interval to the next sample uniformly around its mean,
+    // so that periodic allocation patterns are not sampled in lockstep
+    if (allocSampleBytes > 0)
+    {
+        allocSampleSeed ^= allocSampleSeed << 13;
+        allocSampleSeed ^= allocSampleSeed >> 7;
+        allocSampleSeed ^= allocSampleSeed << 17;
+        allocSampleNext += 1 + allocSampleSeed % (2 * allocSampleBytes);
+    }
+
+    allocHook(numBytes, tag, sampledBytes);
+}
+
+void VM::remember(refptr ptr)
+{
+    *(obj_header*)ptr |= HEADER_MSK_REMEMBERED;
+    remSet.push_back(ptr);
+}
+
+void VM::markPtr(refptr ptr)
+{
+    auto& header = *(obj_header*)ptr;
+    if (header & HEADER_MSK_MARK)
+        return;
+
+    header |= HEADER_MSK_MARK;
+    markStack.push_back(ptr);
+}
+
+/// Get the heap pointer held by a value, or null if there is none
+static refptr valRef(Value val)
+{
+    switch (val.getTag())
+    {
+        case TAG_STRING:
+        case TAG_ARRAY:
+        case TAG_OBJECT:
+        case TAG_IMGREF:
+        return (refptr)val;
+
+        default:
+        return nullptr;
+    }
+}
+
+/**
+Get the number of value slots of an object. The field names of objects
+are held by their shape, except in dictionary mode, where the slots
+hold field name and value pairs, followed by a hash table.
+*/
+static size_t numValueSlots(refptr ptr)
+{
+    auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+    auto shape = *(Shape**)(ptr + Object::OF_SHAPE);
+    return (shape == Shape::dict())? (2 * cap):cap;
+}
+
+/**
+Call a function on each heap pointer held by an object. Only the
+array elements with an index in the range [begin, end) are visited.
+*/
+template <typename Visit>
+static void visitRefs(
+    refptr ptr,
+    obj_header header,
+    size_t begin,
+    size_t end,
+    Visit visit
+)
+{
+    // If the object was extended, its own fields are stale,
+    // only the object its next pointer points to is used
+    if (header & HEADER_MSK_NEXT)
+    {
+        visit(*(refptr*)(ptr + OBJ_OF_NEXT));
+        return;
+    }
+
+    switch ((Tag)header)
+    {
+        case TAG_OBJECT:
+        {
+            auto numSlots = numValueSlots(ptr);
+            auto values = (Value*)(ptr + Object::OF_FIELDS);
+            for (size_t i = 0; i < numSlots; ++i)
+                if (auto ref = valRef(values[i]))
+                    visit(ref);
+        }
+        break;
+
+        case TAG_ARRAY:
+        {
+            // Element words and tags are stored in separate arrays
+            auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto words = (Word*)(ptr + Array::OF_DATA);
+            auto tags  = (Tag*) (ptr + Array::OF_DATA + cap * sizeof(Word));
+            end = std::min(end, size_t(len));
+            for (size_t i = begin; i < end; ++i)
+                if (auto ref = valRef(Value(words[i], tags[i])))
+                    visit(ref);
+        }
+        break;
+
+        case TAG_IMGREF:
+        visit(*(refptr*)(ptr + ImgRef::OF_SYM));
+        break;
+
+        case TAG_ROPE:
+        {
+            // Flattened ropes no longer hold their parts
+            for (auto ofs : { Rope::OF_LEFT, Rope::OF_RIGHT, Rope::OF_FLAT })
+                if (auto ref = *(refptr*)(ptr + ofs))
+                    visit(ref);
+        }
+        break;
+
+        default:
+        break;
+    }
+}
+
+void VM::markVal(Value val)
+{
+    if (auto ptr = valRef(val))
+        markPtr(ptr);
+}
+
+bool VM::beginCollect(bool full)
+{
+    // Make the current chunk region walkable
+    retireRegion();
+
+    minorGC = genEnabled && !full && liveBytes < fullTriggerBytes;
+
+    // Estimate how much memory will be traced
+    auto youngBytes = bytesAllocated - lastGCBytes;
+    traceBytes = minorGC? youngBytes:(liveBytes + youngBytes);
+
+    if (minorGC)
+    {
+        // Old objects written to since the last collection
+        // may point to young objects
+        for (auto ptr : remSet)
+        {
+            *(obj_header*)ptr &= ~obj_header(HEADER_MSK_REMEMBERED);
+            markStack.push_back(ptr);
+        }
+
+        // Young strings are kept alive by the string pool
+        Shape::markNames(*this, true);
+    }
+    else
+    {
+        // Old objects keep their mark bit in generational mode
+        if (genEnabled)
+            clearMarks();
+
+        holes.clear();
+        holeIdx = 0;
+        liveBytes = 0;
+
+        Shape::markNames(*this, false);
+    }
+
+    remSet.clear();
+
+    stringPool.markPinned(*this);
+
+    return minorGC;
+}
+
+void VM::markRoot(Value val)
 {
+    markVal(val);
 }
 
+void VM::traceMarked()
+{
+    while (markStack.size() > 0)
+    {
+        auto ptr = markStack.back();
+        markStack.pop_back();
+
+        visitRefs(
+            ptr,
+            *(obj_header*)ptr,
+            0,
+            SIZE_MAX,
+            [this](refptr ref) { markPtr(ref); }
+        );
+    }
+}
+
+namespace
+{
+
+/// Range of the elements of an object to be traced
+struct MarkItem
+{
+    refptr ptr;
+    size_t begin;
+    size_t end;
+};
+
+/// Arrays longer than this are traced in slices,
+/// which can be stolen by other marking threads
+const size_t ARRAY_SLICE_LEN = 1024;
+
+/// Mark stack size above which a thread shares its work
+const size_t SHARE_MIN_ITEMS = 64;
+
 /**
-Allocates a block of memory
-Note that this function guarantees that the memory is zeroed out
+Work-stealing parallel marker. Each thread traces the objects on its own
+mark stack. When that stack grows while the thread has no work left to
+steal, the bottom half of the stack is moved to a shared queue which the
+other threads can steal from. Marking is done once all threads are idle.
 */
-Value VM::alloc(uint32_t size, Tag tag)
+class ParallelMarker
+{
+private:
+
+    struct Worker
+    {
+        /// Objects marked by this thread and not yet traced
+        std::vector<MarkItem> stack;
+
+        /// Work which can be stolen by other threads
+        std::mutex lock;
+        std::vector<MarkItem> shared;
+        std::atomic<size_t> numShared { 0 };
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    /// Number of threads which ran out of work
+    std::atomic<size_t> numIdle { 0 };
+
+    /// Number of work items shared by all threads
+    std::atomic<size_t> totalShared { 0 };
+
+    /// Set the mark bit of an object. Returns false if
+    /// the object was already marked by another thread.
+    static bool tryMark(refptr ptr)
+    {
+        auto header = (obj_header*)ptr;
+
+        if (__atomic_load_n(header, __ATOMIC_RELAXED) & HEADER_MSK_MARK)
+            return false;
+
+        auto old = __atomic_fetch_or(header, HEADER_MSK_MARK, __ATOMIC_RELAXED);
+        return !(old & HEADER_MSK_MARK);
+    }
+
+    void trace(Worker& self, MarkItem item)
+    {
+        // Other threads may be setting the mark bit concurrently
+        auto header = __atomic_load_n((obj_header*)item.ptr, __ATOMIC_RELAXED);
+
+        // Queue the rest of long arrays as a separate item
+        if ((Tag)header == TAG_ARRAY && !(header & HEADER_MSK_NEXT))
+        {
+            auto len = *(uint32_t*)(item.ptr + Array::OF_LEN);
+            auto end = std::min(item.end, size_t(len));
+
+            if (end > item.begin + ARRAY_SLICE_LEN)
+            {
+                auto mid = item.begin + ARRAY_SLICE_LEN;
+                self.stack.push_back({ item.ptr, mid, end });
+                item.end = mid;
+            }
+        }
+
+        visitRefs(
+            item.ptr,
+            header,
+            item.begin,
+            item.end,
+            [&self](refptr ref)
+            {
+                if (tryMark(ref))
+                    self.stack.push_back({ ref, 0, SIZE_MAX });
+            }
+        );
+    }
+
+    /// Move the bottom half of a thread's mark stack to its shared queue
+    void share(Worker& self)
+    {
+        std::lock_guard<std::mutex> guard(self.lock);
+
+        auto numItems = self.stack.size() / 2;
+        auto first = self.stack.begin();
+        self.shared.insert(self.shared.end(), first, first + numItems);
+        self.stack.erase(first, first + numItems);
+
+        self.numShared = self.shared.size();
+        totalShared += numItems;
+    }
+
+    /// Take back the work a thread shared, if no other thread stole it
+    bool reclaim(Worker& self)
+    {
+        std::lock_guard<std::mutex> guard(self.lock);
+
+        if (self.shared.empty())
+            return false;
+
+        auto numItems = self.shared.size();
+        self.stack.swap(self.shared);
+        self.shared.clear();
+
+        self.numShared = 0;
+        totalShared -= numItems;
+        return true;
+    }
+
+    /// Steal half of the shared work of another thread
+    bool steal(size_t idx)
+    {
+        auto& self = *workers[idx];
+
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            auto& victim = *workers[(idx + i) % workers.size()];
+            if (victim.numShared == 0)
+                continue;
+
+            std::lock_guard<std::mutex> guard(victim.lock);
+
+            auto numItems = (victim.shared.size() + 1) / 2;
+            if (numItems == 0)
+                continue;
+
+            auto last = victim.shared.end();
+            self.stack.insert(self.stack.end(), last - numItems, last);
+            victim.shared.erase(last - numItems, last);
+
+            victim.numShared = victim.shared.size();
+            totalShared -= numItems;
+            return true;
+        }
+
+        return false;
+    }
+
+    void work(size_t idx)
+    {
+        auto& self = *workers[idx];
+
+        for (;;)
+        {
+            while (self.stack.size() > 0)
+            {
+                auto item = self.stack.back();
+                self.stack.pop_back();
+                trace(self, item);
+
+                if (self.stack.size() >= SHARE_MIN_ITEMS && self.numShared == 0)
+                    share(self);
+            }
+
+            if (reclaim(self) || steal(idx))
+                continue;
+
+            // Wait until some thread shares work, or until all
+            // threads are idle, in which case no work is left
+            numIdle++;
+            for (;;)
+            {
+                if (numIdle == workers.size())
+                    return;
+
+                if (totalShared > 0)
+                {
+                    numIdle--;
+                    break;
+                }
+
+                std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+
+    /// Split the marked roots between a number of threads
+    ParallelMarker(size_t numThreads, const std::vector<refptr>& roots)
+    {
+        for (size_t i = 0; i < numThreads; ++i)
+            workers.emplace_back(new Worker());
+
+        for (size_t i = 0; i < roots.size(); ++i)
+            workers[i % numThreads]->stack.push_back({ roots[i], 0, SIZE_MAX });
+    }
+
+    /// Trace the heap, the calling thread acts as the first worker
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers.size(); ++i)
+            threads.emplace_back(&ParallelMarker::work, this, i);
+
+        work(0);
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+};
+
+}
+
+void VM::traceParallel()
+{
+    ParallelMarker marker(markThreads, markStack);
+    markStack.clear();
+    marker.run();
+}
+
+void VM::addHole(refptr ptr, size_t numBytes)
+{
+    formatFree(ptr, numBytes);
+
+    if (numBytes >= MIN_HOLE_SIZE)
+        holes.push_back({ ptr, numBytes });
+}
+
+/// Sweep a range of chunk memory, turning the space between live
+/// objects into free blocks. Live objects keep their mark bit
+/// if requested, so that they become old objects.
+size_t VM::sweepRange(refptr start, refptr end, bool keepMarks)
+{
+    refptr freeStart = nullptr;
+    size_t numLive = 0;
+
+    for (auto ptr = start; ptr < end;)
+    {
+        auto& header = *(obj_header*)ptr;
+        auto numBytes = headerSize(header);
+        assert (numBytes > 0);
+
+        if ((Tag)header != TAG_FREE && (header & HEADER_MSK_MARK))
+        {
+            if (!keepMarks)
+                header &= ~obj_header(HEADER_MSK_MARK);
+            numLive += numBytes;
+
+            if (freeStart)
+            {
+                addHole(freeStart, ptr - freeStart);
+                freeStart = nullptr;
+            }
+        }
+        else if (!freeStart)
+        {
+            freeStart = ptr;
+        }
+
+        ptr += numBytes;
+    }
+
+    if (freeStart)
+        addHole(freeStart, end - freeStart);
+
+    return numLive;
+}
+
+/// Clear the mark and remembered bits of all objects
+void VM::clearMarks()
+{
+    auto clearMsk = ~obj_header(HEADER_MSK_MARK | HEADER_MSK_REMEMBERED);
+
+    for (auto chunk : chunks)
+    {
+        for (auto ptr = chunk; ptr < chunk + CHUNK_SIZE;)
+        {
+            auto& header = *(obj_header*)ptr;
+            ptr += headerSize(header);
+            header &= clearMsk;
+        }
+    }
+
+    for (auto obj : largeObjs)
+        *(obj_header*)obj.first &= clearMsk;
+}
+
+/// Sweep all the chunks. Chunks without any live object are released.
+void VM::sweepChunks()
 {
-    // FIXME: use an alloc pool of some kind
-    auto ptr = (refptr)calloc(1, size);
+    size_t numChunks = 0;
+
+    for (auto chunk : chunks)
+    {
+        auto numHoles = holes.size();
+        auto chunkLive = sweepRange(chunk, chunk + CHUNK_SIZE, genEnabled);
+
+        if (chunkLive == 0)
+        {
+            holes.resize(numHoles);
+            free(chunk);
+            continue;
+        }
+
+        liveBytes += chunkLive;
+        chunks[numChunks++] = chunk;
+    }
+
+    chunks.resize(numChunks);
+}
+
+/// Sweep the chunk regions allocated in since the last collection
+void VM::sweepYoung()
+{
+    // Keep the free memory not yet reused
+    holes.erase(holes.begin(), holes.begin() + holeIdx);
+    holeIdx = 0;
+
+    for (auto region : youngRegions)
+        liveBytes += sweepRange(region.first, region.second, true);
+}
+
+void VM::sweepLarge(size_t startIdx)
+{
+    size_t numObjs = startIdx;
+
+    for (size_t i = startIdx; i < largeObjs.size(); ++i)
+    {
+        auto obj = largeObjs[i];
+        auto& header = *(obj_header*)obj.first;
+
+        if (header & HEADER_MSK_MARK)
+        {
+            if (!genEnabled)
+                header &= ~obj_header(HEADER_MSK_MARK);
+            liveBytes += obj.second;
+            largeObjs[numObjs++] = obj;
+        }
+        else
+        {
+            free(obj.first);
+        }
+    }
+
+    largeObjs.resize(numObjs);
+}
+
+void VM::endCollect()
+{
+    // Small heaps are not worth starting threads for
+    if (markThreads > 1 && traceBytes >= PAR_MARK_MIN_BYTES)
+        traceParallel();
+    else
+        traceMarked();
+
+    // The string pool does not keep strings alive, dead
+    // strings are removed before their memory is reused
+    stringPool.sweep(minorGC);
+
+    if (minorGC)
+    {
+        sweepYoung();
+        sweepLarge(youngLargeIdx);
+    }
+    else
+    {
+        sweepChunks();
+        sweepLarge(0);
+        fullTriggerBytes = std::max(gcMinBytes, 2 * liveBytes);
+    }
 
-    // Set the tag in the object header
-    *(Tag*)ptr = tag;
+    youngRegions.clear();
+    youngLargeIdx = largeObjs.size();
 
-    // Wrap the pointer in a tagged value
-    return Value(ptr, tag);
+    if (genEnabled)
+    {
+        gcTriggerBytes = bytesAllocated + nurseryBytes;
+    }
+    else
+    {
+        // Let the heap grow in proportion to the live data
+        gcTriggerBytes = bytesAllocated + std::max(gcMinBytes, liveBytes);
+    }
+
+    lastGCBytes = bytesAllocated;
+    minorGC = false;
+    gcCount++;
 }
 
 void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
 {
+    vm.writeBarrier(obj);
+
     // Get the object header
     auto header = *(obj_header*)obj;
 
@@ -137,6 +849,11 @@ String::String(std::string str)
 String::String(Value value)
 {
     assert (value.isString());
+    auto ptr = (refptr)value;
+
+    if ((Tag)*(obj_header*)ptr == TAG_ROPE)
+        value = Value(Rope::flatten(ptr), TAG_STRING);
+
     this->val = value;
 }
 
@@ -181,38 +898,74 @@ char String::operator [] (size_t i)
 
 String String::concat(String a, String b)
 {
-    auto lenA = a.length();
-    auto lenB = b.length();
+    return stringPool.concat(a, b);
+}
 
-    std::string c;
-    c.resize(lenA + lenB);
+Value Rope::concat(Value a, Value b)
+{
+    auto lenA = strLength(a);
+    auto lenB = strLength(b);
+
+    if (lenA == 0)
+        return b;
+    if (lenB == 0)
+        return a;
+
+    if (lenA + lenB < MIN_LEN)
+        return String::concat(a, b);
 
-    for (size_t i = 0; i < lenA; ++i)
-        c[i] = a[i];
+    if (uint64_t(lenA) + lenB > UINT32_MAX)
+        throw RunError("string concatenation result is too long");
 
-    for (size_t i = 0; i < lenB; ++i)
-        c[lenA + i] = b[i];
+    auto ptr = vm.alloc(SIZE, TAG_ROPE).getWord().ptr;
+    *(uint32_t*)(ptr + OF_LEN) = lenA + lenB;
+    *(refptr*)(ptr + OF_LEFT) = (refptr)a;
+    *(refptr*)(ptr + OF_RIGHT) = (refptr)b;
 
-    return String(c);
+    return Value(ptr, TAG_STRING);
 }
 
-/// Allocate a new array of a given length
-Array::Array(size_t minCap)
+refptr Rope::flatten(refptr rope)
 {
-    // Compute the object size
-    auto numBytes = memSize(minCap);
+    if (auto flat = *(refptr*)(rope + OF_FLAT))
+        return flat;
 
-    // Allocate memory
-    val = vm.alloc(numBytes, TAG_ARRAY);
-    auto ptr = (refptr)val;
+    std::string data;
+    data.reserve(*(uint32_t*)(rope + OF_LEN));
 
-    // Set the array capacity and length
-    *(uint32_t*)(ptr + OF_CAP) = minCap;
-    *(uint32_t*)(ptr + OF_LEN) = 0;
+    // Append the strings at the leaves from left to right
+    std::vector<refptr> stack = { rope };
+    while (stack.size() > 0)
+    {
+        auto ptr = stack.back();
+        stack.pop_back();
 
-    // No initialization necessary because vm.alloc
-    // provides zeroed out memory, initialized to all zeroes,
-    // which evaluates to $undef.
+        if ((Tag)*(obj_header*)ptr == TAG_ROPE)
+        {
+            if (auto flat = *(refptr*)(ptr + OF_FLAT))
+            {
+                ptr = flat;
+            }
+            else
+            {
+                stack.push_back(*(refptr*)(ptr + OF_RIGHT));
+                stack.push_back(*(refptr*)(ptr + OF_LEFT));
+                continue;
+            }
+        }
+
+        auto len = *(uint32_t*)(ptr + String::OF_LEN);
+        data.append((char*)(ptr + String::OF_DATA), len);
+    }
+
+    // Release the parts, which may no longer be needed
+    auto flat = (refptr)stringPool.getString(data);
+    vm.writeBarrier(rope);
+    *(refptr*)(rope + OF_LEFT) = nullptr;
+    *(refptr*)(rope + OF_RIGHT) = nullptr;
+    *(refptr*)(rope + OF_FLAT) = flat;
+
+    return flat;
 }
 
 Array::Array(Value value)
@@ -221,11 +974,38 @@ Array::Array(Value value)
     this->val = value;
 }
 
-size_t Array::getCap()
-{
-    auto ptr = getObjPtr();
-    auto cap = *(uint32_t*)(ptr + OF_CAP);
-    return cap;
+size_t Array::getCap()
+{
+    auto ptr = getObjPtr();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    return cap;
+}
+
+/// Move the elements into new storage with a given capacity. The
+/// array object itself keeps a next pointer to its current storage,
+/// so there is never more than one level of indirection.
+refptr Array::resize(refptr ptr, uint32_t newCap)
+{
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto len = *(uint32_t*)(ptr + OF_LEN);
+    assert (len <= newCap);
+
+    auto newPtr = (refptr)Array(newCap);
+
+    // Copy the words and tags in bulk
+    memcpy(newPtr + OF_DATA, ptr + OF_DATA, len * sizeof(Word));
+    memcpy(
+        newPtr + OF_DATA + newCap * sizeof(Word),
+        ptr + OF_DATA + cap * sizeof(Word),
+        len * sizeof(Tag)
+    );
+    *(uint32_t*)(newPtr + OF_LEN) = len;
+
+    // Previous storage other than the array object becomes garbage
+    setNextPtr((refptr)this->val, newPtr);
+    assert (getObjPtr() == newPtr);
+
+    return newPtr;
 }
 
 uint32_t Array::length()
@@ -239,13 +1019,13 @@ uint32_t Array::length()
 void Array::setElem(size_t i, Value v)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
 
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
-    assert (length() <= getCap());
-    assert (i < length());
+    assert (i < *(uint32_t*)(ptr + OF_LEN));
+    vm.writeBarrier(ptr);
     words[i] = v.getWord();
     tags[i] = v.getTag();
 }
@@ -254,13 +1034,12 @@ void Array::setElem(size_t i, Value v)
 Value Array::getElem(size_t i)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
 
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
-    assert (length() <= getCap());
-    assert (i < length());
+    assert (i < *(uint32_t*)(ptr + OF_LEN));
     auto word = words[i];
     auto tag = tags[i];
 
@@ -270,36 +1049,24 @@ Value Array::getElem(size_t i)
 void Array::push(Value val)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto len = length();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto len = *(uint32_t*)(ptr + OF_LEN);
     assert (len <= cap);
 
-    // If the array is at capacity
+    // If the array is at capacity, double its capacity
     if (len == cap)
     {
-        // Create a new array with twice the capacity
-        auto newCap = 2 * cap + 1;
-        //std::cerr << "extending array capacity from " << cap << " to " << newCap << std::endl;
-        auto newArr = Array(newCap);
-
-        // Copy elements to the new array
-        for (size_t i = 0; i < len; ++i)
-            newArr.push(getElem(i));
-
-        // Set the next pointer on this object
-        auto rootObjPtr = (refptr)this->val;
-        setNextPtr(rootObjPtr, newArr.getObjPtr());
-        assert (getObjPtr() != ptr);
-
-        ptr = getObjPtr();
-        cap = newCap;
+        if (cap >= UINT32_MAX / 2)
+            throw RunError("array length exceeds maximum");
 
-        //std::cout << "done extending array" << std::endl;
+        cap = 2 * cap + 1;
+        ptr = resize(ptr, cap);
     }
 
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
+    vm.writeBarrier(ptr);
     words[len] = val.getWord();
     tags[len] = val.getTag();
 
@@ -310,8 +1077,8 @@ void Array::push(Value val)
 Value Array::pop()
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto len = length();
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto len = *(uint32_t*)(ptr + OF_LEN);
     assert (len > 0);
 
     auto words = (Word*)(ptr + OF_DATA);
@@ -320,33 +1087,121 @@ Value Array::pop()
     auto word = words[len-1];
     auto tag = tags[len-1];
 
-    // Increment the length
+    // Decrement the length
     *(uint32_t*)(ptr + OF_LEN) = len - 1;
 
+    // Halve the capacity when the array is a quarter full, which
+    // leaves room to push again before the array grows back
+    if (cap >= MIN_SHRINK_CAP && len - 1 <= cap / 4)
+        resize(ptr, cap / 2);
+
     return Value(word, tag);
 }
 
-/// Allocate a new empty object
-Object Object::newObject(size_t cap)
+/**
+Field name to slot index table. A table is shared by a chain of shapes,
+each adding one field to the previous one, and can only be extended by
+the last shape of the chain.
+*/
+class FieldTable
 {
-    if (cap < MIN_CAP)
-        cap = MIN_CAP;
+public:
 
-    // Compute the object size
-    auto numBytes = memSize(cap);
+    std::unordered_map<refptr, uint32_t> slots;
 
-    // Allocate memory
-    auto val = vm.alloc(numBytes, TAG_OBJECT);
-    auto ptr = (refptr)val;
+    Shape* last;
+};
 
-    // Set the object capacity
-    *(uint32_t*)(ptr + OF_CAP) = cap;
+/// All shapes with fields, in creation order
+static std::vector<Shape*> allShapes;
 
-    // TODO: init object shape, when shapes actually implemented!
+/// Number of shapes created before the last collection
+static size_t numOldShapes = 0;
 
-    // No field initialization necessary
+Shape* Shape::emptyShape = new Shape(nullptr, Value::UNDEF);
+Shape* Shape::dictShape = new Shape(nullptr, Value::UNDEF);
 
-    return val;
+Shape::Shape(Shape* parent, Value name)
+: parent(parent),
+  name(name),
+  numFields(parent? (parent->numFields + 1):0)
+{
+    if (parent)
+        allShapes.push_back(this);
+}
+
+size_t Shape::getSlotIdx(String fieldName)
+{
+    auto namePtr = (refptr)fieldName;
+
+    if (numFields <= MAX_LINEAR_FIELDS)
+    {
+        for (auto shape = this; shape->parent; shape = shape->parent)
+        {
+            if ((refptr)shape->name == namePtr)
+                return shape->numFields - 1;
+        }
+
+        return NOT_FOUND;
+    }
+
+    if (!table)
+    {
+        table = new FieldTable();
+        table->last = this;
+
+        for (auto shape = this; shape->parent; shape = shape->parent)
+            table->slots[(refptr)shape->name] = shape->numFields - 1;
+    }
+
+    // The table may contain fields added by shapes extending this one
+    auto itr = table->slots.find(namePtr);
+    if (itr == table->slots.end() || itr->second >= numFields)
+        return NOT_FOUND;
+
+    return itr->second;
+}
+
+Shape* Shape::addField(String fieldName)
+{
+    auto namePtr = (refptr)fieldName;
+
+    auto itr = transitions.find(namePtr);
+    if (itr != transitions.end())
+        return itr->second;
+
+    if (transitions.size() >= MAX_TRANSITIONS ||
+        allShapes.size() >= MAX_SHAPES)
+        return nullptr;
+
+    auto shape = new Shape(this, fieldName);
+    transitions[namePtr] = shape;
+
+    // Extend the field table, unless another shape already did
+    if (table && table->last == this)
+    {
+        table->slots[namePtr] = numFields;
+        table->last = shape;
+        shape->table = table;
+    }
+
+    return shape;
+}
+
+void Shape::getFieldNames(std::vector<Value>& names)
+{
+    names.resize(numFields);
+
+    for (auto shape = this; shape->parent; shape = shape->parent)
+        names[shape->numFields - 1] = shape->name;
+}
+
+void Shape::markNames(VM& vm, bool youngOnly)
+{
+    for (size_t i = youngOnly? numOldShapes:0; i < allShapes.size(); ++i)
+        vm.markRoot(allShapes[i]->name);
+
+    numOldShapes = allShapes.size();
 }
 
 Object::Object(Value value)
@@ -364,137 +1219,297 @@ size_t Object::getCap()
     return cap;
 }
 
-size_t Object::getSlotIdx(
-    refptr ptr,
-    size_t cap,
-    String fieldName,
-    bool newField
-)
+/// Hash a field name for dictionary lookups. Field names
+/// are compared by identity, so their address is hashed.
+static size_t hashName(refptr namePtr)
 {
-    auto values = (Value*)(ptr + OF_FIELDS);
+    auto hash = uint64_t(namePtr) * 0x9E3779B97F4A7C15;
+    return size_t(hash ^ (hash >> 32));
+}
 
-    // FIXME: for now, we use a dumb key-pair linear search strategy
-    size_t idx = 0;
-    for (; idx < cap; idx += 2)
+/// Find the field pair at which a name is stored in a dictionary
+static size_t dictFind(refptr ptr, refptr namePtr)
+{
+    auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+    auto pairs = (Value*)(ptr + Object::OF_FIELDS);
+    auto table = (uint32_t*)(pairs + 2 * cap) + 1;
+    auto mask = 2 * cap - 1;
+
+    // Table entries hold a pair index plus one, zero means empty
+    for (auto i = hashName(namePtr) & mask;; i = (i + 1) & mask)
     {
-        // Empty slot, property name not found
-        if (values[idx] == Value::UNDEF)
-            return newField? idx:cap;
+        auto entry = table[i];
+        if (entry == 0)
+            return Shape::NOT_FOUND;
+
+        if ((refptr)pairs[2 * (entry - 1)] == namePtr)
+            return entry - 1;
+    }
+}
+
+size_t Object::findSlot(refptr ptr, Shape* shape, String name)
+{
+    if (shape != Shape::dict())
+        return shape->getSlotIdx(name);
+
+    auto pairIdx = dictFind(ptr, name);
+    if (pairIdx == Shape::NOT_FOUND)
+        return Shape::NOT_FOUND;
+
+    return 2 * pairIdx + 1;
+}
+
+refptr Object::newDict(size_t cap)
+{
+    // The capacity must be a power of two for hashing
+    assert ((cap & (cap - 1)) == 0);
 
-        assert (values[idx].isString());
+    auto ptr = (refptr)vm.alloc(dictMemSize(cap), TAG_OBJECT);
+    *(uint32_t*)(ptr + OF_CAP) = cap;
+    *(Shape**)(ptr + OF_SHAPE) = Shape::dict();
+
+    return ptr;
+}
+
+size_t Object::dictAdd(refptr ptr, String name, Value value)
+{
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto pairs = (Value*)(ptr + OF_FIELDS);
+    auto& numFields = *(uint32_t*)(pairs + 2 * cap);
+    auto table = &numFields + 1;
+    auto mask = 2 * cap - 1;
+    assert (numFields < cap);
+
+    auto pairIdx = numFields++;
+    vm.writeBarrier(ptr);
+    pairs[2 * pairIdx + 0] = name;
+    pairs[2 * pairIdx + 1] = value;
+
+    auto i = hashName(name) & mask;
+    while (table[i] != 0)
+        i = (i + 1) & mask;
+    table[i] = pairIdx + 1;
+
+    return 2 * pairIdx + 1;
+}
+
+size_t Object::addDictField(refptr ptr, String name, Value value)
+{
+    auto cap = *(uint32_t*)(ptr + OF_CAP);
+    auto pairs = (Value*)(ptr + OF_FIELDS);
+    auto numFields = *(uint32_t*)(pairs + 2 * cap);
+
+    // If the dictionary is full, copy the fields to
+    // a new dictionary with twice the capacity
+    if (numFields == cap)
+    {
+        auto newPtr = newDict(2 * cap);
+        for (size_t i = 0; i < numFields; ++i)
+            dictAdd(newPtr, pairs[2 * i], pairs[2 * i + 1]);
 
-        // Slot found
-        if ((String)values[idx] == fieldName)
-            return idx;
+        setNextPtr((refptr)val, newPtr);
+        ptr = newPtr;
     }
 
-    return cap;
+    return dictAdd(ptr, name, value);
+}
+
+size_t Object::makeDict(refptr ptr, String name, Value value)
+{
+    auto shape = getShape(ptr);
+    auto values = (Value*)(ptr + OF_FIELDS);
+
+    std::vector<Value> names;
+    shape->getFieldNames(names);
+
+    // Leave room to grow without rehashing right away
+    size_t cap = MIN_CAP;
+    while (cap < 2 * (names.size() + 1))
+        cap *= 2;
+
+    auto dictPtr = newDict(cap);
+    for (size_t i = 0; i < names.size(); ++i)
+        dictAdd(dictPtr, names[i], values[i]);
+
+    setNextPtr((refptr)val, dictPtr);
+
+    return dictAdd(dictPtr, name, value);
 }
 
 bool Object::hasField(String fieldName)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto slotIdx = findSlot(ptr, getShape(ptr), fieldName);
+    return slotIdx != Shape::NOT_FOUND;
+}
 
-    auto slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+bool Object::hasField(String name, FieldCache& cache)
+{
+    auto ptr = getObjPtr();
+    auto shape = getShape(ptr);
+
+    // Fields can be added to dictionaries without changing their shape
+    if (shape == Shape::dict())
+        return findSlot(ptr, shape, name) != Shape::NOT_FOUND;
+
+    // Missing fields are cached with a NOT_FOUND slot index
+    if (shape != cache.shape || (refptr)name != cache.name)
+    {
+        cache.shape = shape;
+        cache.name = name;
+        cache.slotIdx = shape->getSlotIdx(name);
+        cache.newShape = nullptr;
+    }
 
-    return (slotIdx < cap);
+    return cache.slotIdx != Shape::NOT_FOUND;
 }
 
 void Object::setField(String name, Value value)
+{
+    FieldCache cache;
+    setField(name, value, cache);
+}
+
+void Object::setField(String name, Value value, FieldCache& cache)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto shape = getShape(ptr);
+    auto values = (Value*)(ptr + OF_FIELDS);
+
+    if (shape == cache.shape && (refptr)name == cache.name && cache.newShape)
+    {
+        // Existing field
+        if (cache.newShape == shape)
+        {
+            // Dictionary slots are checked against the field name
+            if (shape != Shape::dict() || (
+                cache.slotIdx < 2 * *(uint32_t*)(ptr + OF_CAP) &&
+                values[cache.slotIdx - 1] == Value(name)))
+            {
+                vm.writeBarrier(ptr);
+                values[cache.slotIdx] = value;
+                return;
+            }
+        }
+
+        // Field added without exceeding the object capacity
+        else if (cache.slotIdx < *(uint32_t*)(ptr + OF_CAP))
+        {
+            *(Shape**)(ptr + OF_SHAPE) = cache.newShape;
+            vm.writeBarrier(ptr);
+            values[cache.slotIdx] = value;
+            return;
+        }
+    }
+
+    cache.shape = shape;
+    cache.name = name;
+    cache.newShape = shape;
+    cache.slotIdx = findSlot(ptr, shape, name);
+
+    if (cache.slotIdx != Shape::NOT_FOUND)
+    {
+        vm.writeBarrier(ptr);
+        values[cache.slotIdx] = value;
+        return;
+    }
+
+    // Fields added to dictionaries are not cached
+    if (shape == Shape::dict())
+    {
+        cache.newShape = nullptr;
+        addDictField(ptr, name, value);
+        return;
+    }
+
+    // Adding a field changes the shape of the object. Objects with
+    // many fields, or used as maps with many different keys, switch
+    // to dictionary mode instead.
+    cache.newShape = nullptr;
+    auto newShape = (
+        (shape->getNumFields() < MAX_SHAPE_FIELDS)?
+        shape->addField(name):nullptr
+    );
 
-    auto slotIdx = getSlotIdx(ptr, cap, name, true);
+    if (!newShape)
+    {
+        makeDict(ptr, name, value);
+        return;
+    }
+
+    cache.slotIdx = shape->getNumFields();
+    cache.newShape = newShape;
 
     // If we've exceeded the object capacity
-    if (slotIdx + 1 >= cap)
+    auto cap = getCap();
+    if (cache.slotIdx >= cap)
     {
         // Create a new object with twice the capacity
-        assert (cap > 0);
-        auto newCap = 2 * cap;
-        //std::cout << "extending object capacity from " << cap << " to " << newCap << std::endl;
-        auto newObj = Object::newObject(newCap);
+        auto newObj = Object::newObject(2 * cap);
+        auto newObjPtr = newObj.getObjPtr();
 
-        // Copy properties to the new object
-        for (auto itr = ObjFieldItr(*this); itr.valid(); itr.next())
-        {
-            auto fieldName = itr.get();
-            auto fieldVal = getField(fieldName);
-            newObj.setField(fieldName, fieldVal);
-        }
+        // Copy the field values to the new object
+        memcpy(newObjPtr + OF_FIELDS, ptr + OF_FIELDS, cap * sizeof(Value));
 
         // Set the next pointer on this object
-        auto newObjPtr = newObj.getObjPtr();
         auto rootObjPtr = (refptr)val;
         setNextPtr(rootObjPtr, newObjPtr);
-        assert (getObjPtr() != ptr);
+        assert (getObjPtr() == newObjPtr);
 
-        ptr = getObjPtr();
-        cap = getCap();
+        ptr = newObjPtr;
     }
 
-    // Write the new property
-    assert (slotIdx + 1 < cap);
-    auto values = (Value*)(ptr + OF_FIELDS);
-    values[slotIdx + 0] = name;
-    values[slotIdx + 1] = value;
+    *(Shape**)(ptr + OF_SHAPE) = cache.newShape;
+
+    // Write the field value
+    vm.writeBarrier(ptr);
+    values = (Value*)(ptr + OF_FIELDS);
+    values[cache.slotIdx] = value;
 }
 
 Value Object::getField(String name)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
     auto values = (Value*)(ptr + OF_FIELDS);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, name, false);
+    auto slotIdx = findSlot(ptr, getShape(ptr), name);
 
-    assert (slotIdx < cap);
-    return values[slotIdx + 1];
+    assert (slotIdx != Shape::NOT_FOUND);
+    return values[slotIdx];
 }
 
-bool Object::getField(const String& fieldName, Value& value, size_t& idxCache)
+bool Object::getField(String name, Value& value, FieldCache& cache)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto shape = getShape(ptr);
     auto values = (Value*)(ptr + OF_FIELDS);
 
-    //std::cout << "Lookup" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-    //std::cout << "  idxCache=" << idxCache << std::endl;
-
-    if (idxCache < cap)
+    if (shape == cache.shape && (refptr)name == cache.name)
     {
-        auto nameSlot = values[idxCache];
-        if (nameSlot.isString())
+        // Dictionary slots are checked against the field name
+        if (shape != Shape::dict() || (
+            cache.slotIdx < 2 * *(uint32_t*)(ptr + OF_CAP) &&
+            values[cache.slotIdx - 1] == Value(name)))
         {
-            auto nameSlotStr = String(nameSlot);
-            if (nameSlotStr == fieldName)
-            {
-                //std::cout << "  cache hit" << std::endl;
-                value = values[idxCache + 1];
-                return true;
-            }
+            fieldCacheHits++;
+            value = values[cache.slotIdx];
+            return true;
         }
     }
 
-    //std::cout << "cache miss" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-
-    size_t slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+    fieldCacheMisses++;
+    auto slotIdx = findSlot(ptr, shape, name);
 
-    if (slotIdx >= cap)
+    if (slotIdx == Shape::NOT_FOUND)
     {
         return false;
     }
 
-    idxCache = slotIdx;
+    cache.shape = shape;
+    cache.name = name;
+    cache.slotIdx = slotIdx;
 
-    //std::cout << "  cache miss" << std::endl;
-    //std::cout << "  slotIdx=" << slotIdx << std::endl;
-
-    value = values[slotIdx + 1];
+    value = values[slotIdx];
     return true;
 }
 
@@ -538,47 +1553,45 @@ Array Object::getFieldArr(std::string name)
 }
 
 ObjFieldItr::ObjFieldItr(Object obj)
-: obj(obj)
 {
+    auto ptr = obj.getObjPtr();
+    auto shape = obj.getShape(ptr);
+
+    if (shape != Shape::dict())
+    {
+        shape->getFieldNames(names);
+        return;
+    }
+
+    // Dictionary fields are stored in insertion order
+    auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+    auto pairs = (Value*)(ptr + Object::OF_FIELDS);
+    auto numFields = *(uint32_t*)(pairs + 2 * cap);
+    for (size_t i = 0; i < numFields; ++i)
+        names.push_back(pairs[2 * i]);
 }
 
 bool ObjFieldItr::valid()
 {
-    //std::cout << "valid" << std::endl;
-
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    return slotIdx < cap && values[slotIdx].isString();
+    return slotIdx < names.size();
 }
 
 std::string ObjFieldItr::get()
 {
-    auto ptr = obj.getObjPtr();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    //std::cout << "cap=" << cap << std::endl;
-    //std::cout << "tag=" << (int)values[slotIdx].getTag() << std::endl;
-
-    assert (values[slotIdx].isString());
-
-    return values[slotIdx];
+    assert (names[slotIdx].isString());
+    return names[slotIdx];
 }
 
 void ObjFieldItr::next()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    slotIdx += 2;
-
-    if (slotIdx >= cap)
-        return;
+    slotIdx++;
+}
 
-    if (values[slotIdx] == Value::UNDEF)
-        slotIdx = cap;
+ICache::ICache(std::string fieldName)
+: fieldName(fieldName)
+{
+    // The field name is held by native code
+    stringPool.pin(this->fieldName);
 }
 
 ImgRef::ImgRef(String symbol)
@@ -608,6 +1621,54 @@ std::string ImgRef::getName() const
     return (std::string)strVal;
 }
 
+void findReachable(
+    const std::vector<Value>& roots,
+    std::unordered_set<refptr>& reachable
+)
+{
+    std::vector<Value> workList(roots);
+
+    while (workList.size() > 0)
+    {
+        auto val = workList.back();
+        workList.pop_back();
+
+        // Strings and image references hold no values
+        // which could lead to other objects or arrays
+        if (!val.isObject() && !val.isArray())
+            continue;
+
+        auto ptr = (refptr)val;
+        if (ptr == nullptr || reachable.count(ptr))
+            continue;
+        reachable.insert(ptr);
+
+        // Follow the next pointer if the object was extended
+        if (*(obj_header*)ptr & HEADER_MSK_NEXT)
+        {
+            ptr = *(refptr*)(ptr + OBJ_OF_NEXT);
+            reachable.insert(ptr);
+        }
+
+        if (val.isObject())
+        {
+            auto numSlots = numValueSlots(ptr);
+            auto values = (Value*)(ptr + Object::OF_FIELDS);
+            for (size_t i = 0; i < numSlots; ++i)
+                workList.push_back(values[i]);
+        }
+        else
+        {
+            auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto words = (Word*)(ptr + Array::OF_DATA);
+            auto tags  = (Tag*) (ptr + Array::OF_DATA + cap * sizeof(Word));
+            for (size_t i = 0; i < len; ++i)
+                workList.push_back(Value(words[i], tags[i]));
+        }
+    }
+}
+
 //Murmurhash, learn more at: https://en.wikipedia.org/wiki/MurmurHash
 int64_t murmurHash2(const void* key, size_t len, uint64_t seed)
 {
@@ -652,23 +1713,45 @@ int64_t murmurHash2(const void* key, size_t len, uint64_t seed)
     return h;
 }
 
+/// Seed of the string hash function
+const uint64_t STR_HASH_SEED = 1337;
+
 StringPool::StringPool()
+: slots(INIT_SLOTS, nullptr)
 {
 }
 
-Value StringPool::getString(std::string str)
+Value StringPool::getString(const char* data, size_t len)
 {
-    auto iter = pool.find(str);
-    if (iter == pool.end())
+    auto hash = uint32_t(murmurHash2(data, len, STR_HASH_SEED));
+    auto mask = slots.size() - 1;
+
+    for (auto i = hash & mask; slots[i]; i = (i + 1) & mask)
     {
-        return newString(str);
+        String str = Value(slots[i], TAG_STRING);
+        if (str.getHash() == hash &&
+            str.length() == len &&
+            memcmp(str.getDataPtr(), data, len) == 0)
+            return str;
     }
-    return iter->second;
+
+    return newString(data, len, hash);
+}
+
+Value StringPool::concat(String a, String b)
+{
+    auto lenA = a.length();
+    auto lenB = b.length();
+
+    buffer.clear();
+    buffer.append(a.getDataPtr(), lenA);
+    buffer.append(b.getDataPtr(), lenB);
+
+    return getString(buffer);
 }
 
-Value StringPool::newString(std::string str)
+Value StringPool::newString(const char* data, size_t len, uint32_t hash)
 {
-    auto len = str.length();
     // Compute the string object size
     auto numBytes = String::memSize(len);
 
@@ -676,15 +1759,111 @@ Value StringPool::newString(std::string str)
     auto val = vm.alloc(numBytes, TAG_STRING);
     auto ptr = (refptr)val;
 
-    // Set the string length
+    // Set the string length and hash code
     *(uint32_t*)(ptr + String::OF_LEN) = len;
+    *(uint32_t*)(ptr + String::OF_HASH) = hash;
+
+    // Copy the string data, the null terminator is already zeroed
+    memcpy(ptr + String::OF_DATA, data, len);
+
+    // Keep the table at most half full
+    if (2 * (numStrings + 1) > slots.size())
+    {
+        std::vector<refptr> oldSlots(2 * slots.size(), nullptr);
+        oldSlots.swap(slots);
+        numStrings = 0;
+
+        for (auto str : oldSlots)
+            if (str)
+                insert(str);
+    }
 
-    // Copy the string data
-    strcpy((char*)(ptr + String::OF_DATA), str.c_str());
-    pool.insert({str, val});
+    insert(ptr);
+    youngStrings.push_back(ptr);
     return val;
 }
 
+void StringPool::insert(refptr str)
+{
+    auto mask = slots.size() - 1;
+    auto i = String(Value(str, TAG_STRING)).getHash() & mask;
+
+    while (slots[i])
+        i = (i + 1) & mask;
+
+    slots[i] = str;
+    numStrings++;
+}
+
+/// Remove a string, moving back the strings which
+/// follow it so that no lookup stops early
+void StringPool::remove(refptr str)
+{
+    auto mask = slots.size() - 1;
+    auto i = String(Value(str, TAG_STRING)).getHash() & mask;
+
+    while (slots[i] != str)
+    {
+        assert (slots[i]);
+        i = (i + 1) & mask;
+    }
+
+    for (auto j = (i + 1) & mask; slots[j]; j = (j + 1) & mask)
+    {
+        // Move the string at j into the hole, unless its
+        // home slot lies cyclically in the range (i, j]
+        auto home = String(Value(slots[j], TAG_STRING)).getHash() & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i] = nullptr;
+    numStrings--;
+}
+
+void StringPool::pin(Value str)
+{
+    assert (str.isString());
+    pinned.push_back(str);
+}
+
+void StringPool::markPinned(VM& vm)
+{
+    for (auto str : pinned)
+        vm.markRoot(str);
+}
+
+void StringPool::sweep(bool youngOnly)
+{
+    auto isDead = [](refptr str)
+    {
+        return !(*(obj_header*)str & HEADER_MSK_MARK);
+    };
+
+    if (youngOnly)
+    {
+        for (auto str : youngStrings)
+            if (isDead(str))
+                remove(str);
+    }
+    else
+    {
+        // Rebuild the table with the live strings
+        std::vector<refptr> oldSlots(slots.size(), nullptr);
+        oldSlots.swap(slots);
+        numStrings = 0;
+
+        for (auto str : oldSlots)
+            if (str && !isDead(str))
+                insert(str);
+    }
+
+    youngStrings.clear();
+}
+
 bool isValidIdent(std::string identStr)
 {
     if (identStr.length() == 0)
@@ -742,6 +1921,16 @@ std::string tagToStr(Tag tag)
     }
 }
 
+std::string heapTagToStr(Tag tag)
+{
+    switch (tag)
+    {
+        case TAG_IMGREF:    return "imgref";
+        case TAG_ROPE:      return "rope";
+        default:            return tagToStr(tag);
+    }
+}
+
 std::string posToString(Value srcPos)
 {
     assert (srcPos.isObject());
@@ -774,6 +1963,21 @@ void testRuntime()
     assert (str == str2);
     assert ((std::string)str == (std::string)str2);
 
+    // Interned strings, with their hash code stored in the string
+    auto str3 = String::concat(String("foo"), String("bar"));
+    assert (str3 == str);
+    assert (str3.getHash() == uint32_t(murmurHash2("foobar", 6, STR_HASH_SEED)));
+    assert (String(std::string("a\0b", 3)).length() == 3);
+    assert (!(String(std::string("a\0b", 3)) == String("a")));
+
+    // Ropes, flattened into interned strings when wrapped
+    auto half = String(std::string(Rope::MIN_LEN, 'x'));
+    auto rope = Rope::concat(half, Rope::concat(half, String("")));
+    assert (strLength(rope) == 2 * Rope::MIN_LEN);
+    assert (String(rope) == String(std::string(2 * Rope::MIN_LEN, 'x')));
+    assert (String(rope) == String(rope));
+    assert (Rope::concat(String("a"), String("b")) == (Value)String("ab"));
+
     // Arrays
     auto arr = Array(2);
     assert (arr.length() == 0);
@@ -799,6 +2003,18 @@ void testRuntime()
     assert (arr2.getElem(0) == Value::ONE);
     assert (arr2.getElem(1) == Value::TWO);
 
+    // Repeated growth, then shrinking as the array is emptied
+    auto arr4 = Array(0);
+    for (int32_t i = 0; i < 1000; ++i)
+        arr4.push(Value::int32(i));
+    for (int32_t i = 0; i < 1000; ++i)
+        assert (arr4.getElem(i) == Value::int32(i));
+    for (int32_t i = 999; i >= 0; --i)
+        assert (arr4.pop() == Value::int32(i));
+    assert (arr4.length() == 0);
+    arr4.push(Value::TRUE);
+    assert (arr4.getElem(0) == Value::TRUE);
+
     // Regression test: changing element tag
     auto arr3 = Array(2);
     arr3.push(Value::ZERO);
@@ -831,4 +2047,82 @@ void testRuntime()
     for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
         fieldStr += itr.get();
     assert (fieldStr == "foobar");
+
+    // Objects with the same fields share a shape
+    auto obj2 = Object::newObject();
+    obj2.setField("foo", Value::TWO);
+    obj2.setField("bar", Value::ONE);
+    FieldCache cache;
+    Value fieldVal;
+    assert (obj.getField(String("bar"), fieldVal, cache) && fieldVal == Value::TWO);
+    auto objShape = cache.shape;
+    (void)objShape;
+    assert (obj2.getField(String("bar"), fieldVal, cache) && fieldVal == Value::ONE);
+    assert (cache.shape == objShape);
+
+    // Objects used as maps with many different keys switch to
+    // dictionary mode instead of creating a shape for each key
+    for (size_t i = 0; i < 2 * Shape::MAX_TRANSITIONS; ++i)
+    {
+        auto mapObj = Object::newObject();
+        auto key = String("key" + std::to_string(i));
+        FieldCache mapCache;
+        mapObj.setField(key, Value::int32(i), mapCache);
+        assert (mapObj.getField(key) == Value::int32(i));
+        if (i + 1 == 2 * Shape::MAX_TRANSITIONS)
+            assert (mapCache.newShape == nullptr);
+    }
+
+    // Objects with many fields get extended
+    auto bigObj = Object::newObject();
+    for (int32_t i = 0; i < 100; ++i)
+        bigObj.setField("f" + std::to_string(i), Value::int32(i));
+    for (int32_t i = 0; i < 100; ++i)
+        assert (bigObj.getField("f" + std::to_string(i)) == Value::int32(i));
+    assert (!bigObj.hasField("foo"));
+    assert (!obj.hasField("f9"));
+
+    // Objects with many fields are in dictionary mode, and
+    // their fields are still iterated in insertion order
+    size_t numBigFields = 0;
+    for (auto itr = ObjFieldItr(bigObj); itr.valid(); itr.next())
+    {
+        assert (itr.get() == "f" + std::to_string(numBigFields));
+        numBigFields++;
+    }
+    assert (numBigFields == 100);
+
+    // Cached dictionary slots are checked against the field name
+    auto dictObj = Object::newObject();
+    for (int32_t i = 99; i >= 0; --i)
+        dictObj.setField("f" + std::to_string(i), Value::int32(2 * i));
+    FieldCache dictCache;
+    assert (bigObj.getField(String("f70"), fieldVal, dictCache) && fieldVal == Value::int32(70));
+    assert (dictObj.getField(String("f70"), fieldVal, dictCache) && fieldVal == Value::int32(140));
+    assert (dictObj.getField(String("f70"), fieldVal, dictCache) && fieldVal == Value::int32(140));
+    assert (!dictObj.hasField(String("g"), dictCache));
+    dictObj.setField("g", Value::TRUE);
+    assert (dictObj.hasField(String("g"), dictCache));
+
+    auto bigObj2 = Object::newObject();
+    for (int32_t i = 0; i < 50; ++i)
+        bigObj2.setField("f" + std::to_string(i), Value::int32(i));
+    bigObj2.setField("g", Value::TRUE);
+    assert (!bigObj2.hasField("f50"));
+    assert (bigObj2.getField("f49") == Value::int32(49));
+    assert (bigObj2.getField("g") == Value::TRUE);
+
+    // Allocations are word-aligned and zeroed, and counted
+    auto allocBefore = vm.allocated();
+    (void)allocBefore;
+    for (size_t i = 0; i < 2 * VM::CHUNK_SIZE / Array::memSize(3); ++i)
+    {
+        auto arr = Array(3);
+        assert ((uintptr_t)(refptr)arr % sizeof(Word) == 0);
+        assert (((Word*)((refptr)arr + Array::OF_DATA))[0].int64 == 0);
+        assert (((Word*)((refptr)arr + Array::OF_DATA))[2].int64 == 0);
+    }
+    auto bigArr = Array(VM::MAX_CHUNK_ALLOC);
+    assert (bigArr.length() == 0);
+    assert (vm.allocated() >= allocBefore + 2 * VM::CHUNK_SIZE);
 }
@@ -5,6 +5,8 @@
 #include <string>
 #include <cstring>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /// Type tag, 8 bits
 typedef uint8_t Tag;
@@ -36,6 +38,19 @@ const size_t HEADER_SIZE = sizeof(obj_header);
 const size_t HEADER_IDX_NEXT = 15;
 const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
 
+/// Bit flag used by the garbage collector to mark live objects
+const size_t HEADER_IDX_MARK = 14;
+const size_t HEADER_MSK_MARK = 1 << HEADER_IDX_MARK;
+
+/// Bit flag indicating an old object is in the remembered set
+const size_t HEADER_IDX_REMEMBERED = 13;
+const size_t HEADER_MSK_REMEMBERED = 1 << HEADER_IDX_REMEMBERED;
+
+/// Size of objects allocated in heap chunks, in words, stored
+/// in the header so that the garbage collector can walk chunks
+const size_t HEADER_IDX_SIZE = 16;
+const size_t HEADER_MAX_SIZE = 0xFFFF;
+
 /// Offset of the next pointer
 const size_t OBJ_OF_NEXT = HEADER_SIZE;
 
@@ -58,14 +73,44 @@ union Word
 
 /**
 Tagged value pair type (64-bit word + tag)
+
+When built with PACKED_VALUES, the tag and the payload are packed into
+a single 64-bit word. The tag is stored in the upper 16 bits and the
+payload in the lower 48 bits, which is enough for int32 and float32
+values as well as user-space pointers. This halves the size of values
+on the stack and in object slots. The JIT requires unpacked values.
 */
 class Value
 {
 private:
 
+#ifdef PACKED_VALUES
+
+    /// Tag in the upper 16 bits, payload in the lower 48 bits
+    uint64_t bits;
+
+    static const int TAG_SHIFT = 48;
+    static const uint64_t PAYLOAD_MASK = (uint64_t(1) << TAG_SHIFT) - 1;
+
+    static uint64_t pack(Word w, Tag t)
+    {
+        // 32-bit payloads are stored zero-extended
+        if (t == TAG_INT32 || t == TAG_FLOAT32)
+            return (uint64_t(t) << TAG_SHIFT) | uint32_t(w.int32);
+
+        assert ((uint64_t(w.int64) & ~PAYLOAD_MASK) == 0);
+        return (uint64_t(t) << TAG_SHIFT) | uint64_t(w.int64);
+    }
+
+    uint64_t payload() const { return bits & PAYLOAD_MASK; }
+
+#else
+
     Word word;
     Tag tag;
 
+#endif
+
 public:
 
     static const Value ZERO;
@@ -76,30 +121,77 @@ public:
     static const Value TRUE;
     static const Value FALSE;
 
+#ifdef PACKED_VALUES
+    Value() : bits(0) {}
+    Value(Word w, Tag t) : bits(pack(w, t)) {};
+#else
     Value() : Value(UNDEF.word, UNDEF.tag) {}
-    Value(refptr p, Tag t) : Value(Word(p), t) {}
     Value(Word w, Tag t) : word(w), tag(t) {};
+#endif
+    Value(refptr p, Tag t) : Value(Word(p), t) {}
     ~Value() {}
 
     // Static constructors. These are needed because of type ambiguity.
     static Value int32(int32_t v) { return Value(Word((int64_t)v), TAG_INT32); }
     static Value float32(float v) { return Value(Word(v), TAG_FLOAT32); }
 
-    bool isBool() const { return tag == TAG_BOOL; }
-    bool isInt32() const { return tag == TAG_INT32; }
-    bool isFloat32() const { return tag == TAG_FLOAT32; }
-    bool isString() const { return tag == TAG_STRING; }
-    bool isObject() const { return tag == TAG_OBJECT; }
-    bool isArray() const { return tag == TAG_ARRAY; }
-    bool isHostFn() const { return tag == TAG_HOSTFN; }
+    bool isBool() const { return getTag() == TAG_BOOL; }
+    bool isInt32() const { return getTag() == TAG_INT32; }
+    bool isFloat32() const { return getTag() == TAG_FLOAT32; }
+    bool isString() const { return getTag() == TAG_STRING; }
+    bool isObject() const { return getTag() == TAG_OBJECT; }
+    bool isArray() const { return getTag() == TAG_ARRAY; }
+    bool isHostFn() const { return getTag() == TAG_HOSTFN; }
 
+#ifdef PACKED_VALUES
+    Word getWord() const
+    {
+        // int32 values are sign-extended, as in unpacked words
+        if (getTag() == TAG_INT32)
+            return Word((int64_t)(int32_t)bits);
+        return Word((int64_t)payload());
+    }
+
+    Tag getTag() const { return (Tag)(bits >> TAG_SHIFT); }
+#else
     Word getWord() const { return word; }
     Tag getTag() const { return tag; }
+#endif
 
     bool isPointer() const;
 
     std::string toString() const;
 
+#ifdef PACKED_VALUES
+
+    inline operator bool () const
+    {
+        assert (getTag() == TAG_BOOL);
+        return payload()? 1:0;
+    }
+
+    inline operator int32_t () const
+    {
+        assert (getTag() == TAG_INT32);
+        return (int32_t)bits;
+    }
+
+    inline operator float () const
+    {
+        assert (getTag() == TAG_FLOAT32);
+        Word w;
+        w.int32 = (int32_t)bits;
+        return w.float32;
+    }
+
+    inline operator refptr () const
+    {
+        assert (isPointer());
+        return (refptr)payload();
+    }
+
+#else
+
     inline operator bool () const
     {
         assert (tag == TAG_BOOL);
@@ -124,11 +216,17 @@ public:
         return word.ptr;
     }
 
+#endif
+
     operator std::string () const;
 
     bool operator == (const Value& that) const
     {
+#ifdef PACKED_VALUES
+        return this->bits == that.bits;
+#else
         return this->word.int64 == that.word.int64 && this->tag == that.tag;
+#endif
     }
 
     bool operator != (const Value& that) const
@@ -137,29 +235,259 @@ public:
     }
 };
 
+#ifdef PACKED_VALUES
+static_assert(sizeof(Value) == 8, "packed values should be 64 bits");
+#endif
+
+/**
+Allocation profiling hook. Receives the size and header tag of a sampled
+allocation, and the number of bytes allocated since the previous sample,
+which includes the sampled allocation.
+*/
+typedef void (*AllocHook)(size_t numBytes, Tag tag, size_t sampledBytes);
+
 /**
 Virtual Machine object (singleton)
+
+Heap objects are bump-allocated in large chunks of zeroed memory.
+Objects too large to fit in a chunk get their own memory block.
+
+Memory is reclaimed by a mark & sweep garbage collector. The collector
+is precise and non-moving: a collection is started with beginCollect(),
+every root value is marked with markRoot(), and endCollect() frees the
+objects which were not marked. Free space between the live objects of a
+chunk is reused for bump allocation after a collection.
+
+In generational mode, objects which survive a collection keep their
+mark bit and become old. Minor collections only trace and sweep the
+objects allocated since the last collection. Old objects which get
+written to are added to a remembered set by the write barrier, and
+are traced by minor collections, since they may point to young objects.
+Full collections happen once the old objects have doubled in size.
+
+When more than one marking thread is configured, the objects reachable
+from the roots of large heaps are traced in parallel by worker threads
+which steal work from each other.
 */
 class VM
 {
 private:
 
-    // TODO: total memory size allocated
+    /// Chunks of memory objects are allocated in
+    std::vector<refptr> chunks;
+
+    /// Large objects allocated outside of chunks, with their size
+    std::vector<std::pair<refptr, size_t>> largeObjs;
+
+    /// Free memory ranges in chunks found by the last collection
+    std::vector<std::pair<refptr, size_t>> holes;
+    size_t holeIdx = 0;
+
+    /// Total number of bytes allocated for objects
+    size_t bytesAllocated = 0;
+
+    /// Allocation total at which the next collection is due
+    size_t gcTriggerBytes;
+
+    /// Minimum number of bytes allocated between collections
+    size_t gcMinBytes;
+
+    /// Number of bytes found live by the last collection
+    size_t liveBytes = 0;
+
+    /// Number of collections performed
+    size_t gcCount = 0;
+
+    /// Objects marked but not yet traced
+    std::vector<refptr> markStack;
 
-    // TODO: dynamically grow pools?
+    /// Number of threads used to trace the heap
+    size_t markThreads = 1;
 
-    // TODO: pools for sizes up to 32 (words)
+    /// Allocation total at the end of the last collection
+    size_t lastGCBytes = 0;
 
-    // TODO: number of elements allocated in each pool
+    /// Estimated number of bytes to be traced by the current collection
+    size_t traceBytes = 0;
+
+    /// Generational mode flag and nursery size
+    bool genEnabled = false;
+    size_t nurseryBytes;
+
+    /// Size of the old objects at which the next full collection is due
+    size_t fullTriggerBytes;
+
+    /// Flag set while performing a minor collection
+    bool minorGC = false;
+
+    /// Chunk regions allocated in since the last collection
+    std::vector<std::pair<refptr, refptr>> youngRegions;
+
+    /// Index of the first large object allocated since the last collection
+    size_t youngLargeIdx = 0;
+
+    /// Old objects which may point to young objects
+    std::vector<refptr> remSet;
+
+    /// Add an old object to the remembered set
+    void remember(refptr ptr);
+
+    /// Allocation pointer and limit in the current chunk
+    refptr allocPtr = nullptr;
+    refptr allocLimit = nullptr;
+
+    /// Slow path for allocations which do not fit in the current chunk
+    refptr allocSlow(size_t numBytes);
+
+    /// Allocation profiling hook, and number of bytes between samples
+    AllocHook allocHook = nullptr;
+    size_t allocSampleBytes = 0;
+
+    /// Allocation total at which the next allocation is sampled, and
+    /// allocation total when the last sample was taken
+    size_t allocSampleNext = SIZE_MAX;
+    size_t allocSampleLast = 0;
+
+    /// Pseudorandom state used to vary the interval between samples
+    uint64_t allocSampleSeed = 0x9E3779B97F4A7C15;
+
+    /// Report a sampled allocation to the profiling hook
+    void sampleAlloc(size_t numBytes, Tag tag);
+
+    /// Stop allocating in the current chunk region
+    void retireRegion();
+
+    /// Mark a heap pointer, and queue it to be traced
+    void markPtr(refptr ptr);
+
+    /// Mark a value, if it points to a heap object
+    void markVal(Value val);
+
+    /// Trace the objects on the mark stack
+    void traceMarked();
+
+    /// Trace the objects on the mark stack using multiple threads
+    void traceParallel();
+
+    /// Turn a range of chunk memory into free space
+    void addHole(refptr ptr, size_t numBytes);
+
+    /// Sweep a range of chunk memory. Returns the live bytes found.
+    size_t sweepRange(refptr start, refptr end, bool keepMarks);
+
+    void clearMarks();
+    void sweepChunks();
+    void sweepYoung();
+    void sweepLarge(size_t startIdx);
 
 public:
 
+    /// Size of the memory chunks objects are allocated in
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    /// Objects larger than this are not allocated in chunks
+    static const size_t MAX_CHUNK_ALLOC = CHUNK_SIZE / 8;
+
+    /// Free ranges smaller than this are not reused until
+    /// they are merged with neighboring free memory
+    static const size_t MIN_HOLE_SIZE = 256;
+
+    /// Default minimum number of bytes allocated between collections
+    static const size_t DEFAULT_GC_MIN_BYTES = 16 << 20;
+
+    /// Default nursery size in generational mode
+    static const size_t DEFAULT_NURSERY_BYTES = 4 << 20;
+
+    /// Heaps smaller than this are always traced by a single thread
+    static const size_t PAR_MARK_MIN_BYTES = 8 << 20;
+
     VM();
 
     /// Allocate a block of memory on the heap
-    Value alloc(uint32_t size, Tag tag);
+    /// Note: this memory is guaranteed to be zeroed out
+    Value alloc(uint32_t size, Tag tag)
+    {
+        static_assert(
+            MAX_CHUNK_ALLOC / sizeof(Word) <= HEADER_MAX_SIZE,
+            "chunk object sizes must fit in the object header"
+        );
 
+        // Keep objects aligned on word boundaries
+        size_t numBytes = (size + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+
+        refptr ptr;
+        if (numBytes <= size_t(allocLimit - allocPtr) &&
+            numBytes <= MAX_CHUNK_ALLOC)
+        {
+            ptr = allocPtr;
+            allocPtr += numBytes;
+            bytesAllocated += numBytes;
+        }
+        else
+        {
+            ptr = allocSlow(numBytes);
+        }
+
+        // Set the tag and the chunk object size in the object header
+        obj_header header = tag;
+        if (numBytes <= MAX_CHUNK_ALLOC)
+            header |= obj_header(numBytes / sizeof(Word)) << HEADER_IDX_SIZE;
+        *(obj_header*)ptr = header;
+
+        if (bytesAllocated >= allocSampleNext)
+            sampleAlloc(numBytes, tag);
+
+        // Wrap the pointer in a tagged value
+        return Value(ptr, tag);
+    }
+
+    /// Get the total number of bytes allocated for objects
     size_t allocated() const;
+
+    /// Get the number of bytes found live by the last collection
+    size_t live() const { return liveBytes; }
+
+    /// Get the number of collections performed so far
+    size_t getGCCount() const { return gcCount; }
+
+    /// Set the minimum number of bytes allocated between collections
+    void setGCMinBytes(size_t numBytes);
+
+    /// Enable generational mode, with a given nursery size
+    void enableGenGC(size_t nurseryBytes);
+
+    /// Set the number of threads used to trace the heap
+    void setMarkThreads(size_t numThreads);
+
+    /// Set a hook called on allocations, sampling one allocation every
+    /// given number of bytes, or every allocation if zero
+    void setAllocHook(AllocHook hook, size_t sampleBytes);
+
+    /// Check if enough memory was allocated to start a collection
+    bool gcNeeded() const { return bytesAllocated >= gcTriggerBytes; }
+
+    /**
+    Begin a collection. Marks the strings in the string pool, and the
+    remembered set. Returns true for minor collections, for which only
+    the roots which may point to young objects need to be marked.
+    */
+    bool beginCollect(bool full);
+
+    /// Mark a root value. The objects reachable from the
+    /// roots are traced when the collection ends.
+    void markRoot(Value val);
+
+    /// Trace the objects reachable from the roots,
+    /// then free the objects which were not marked
+    void endCollect();
+
+    /// Write barrier, to be called before storing a value into an object
+    void writeBarrier(refptr ptr)
+    {
+        auto header = *(obj_header*)ptr;
+        if ((header & (HEADER_MSK_MARK | HEADER_MSK_REMEMBERED)) == HEADER_MSK_MARK)
+            remember(ptr);
+    }
 };
 
 /**
@@ -243,10 +571,12 @@ class String : public Wrapper
 {
 public:
 
-    /// Offset and size of the length and data fields
+    /// Offset and size of the length, hash code and data fields
     static const size_t OF_LEN = HEADER_SIZE;
     static const size_t SZ_LEN = sizeof(uint32_t);
-    static const size_t OF_DATA = OF_LEN + SZ_LEN;
+    static const size_t OF_HASH = OF_LEN + SZ_LEN;
+    static const size_t SZ_HASH = sizeof(uint32_t);
+    static const size_t OF_DATA = OF_HASH + SZ_HASH;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t len)
@@ -270,11 +600,17 @@ public:
     /// Comparison with a string literal
     bool operator == (const char* that) const;
 
-    // FIXME: temporary until string interning is implemented
+    /// All strings are interned, so equal strings are the same object
     bool operator == (String that) {
         return val == that.val;
     }
 
+    /// Get the hash code of the string contents
+    uint32_t getHash() const
+    {
+        return *(uint32_t*)((refptr)val + OF_HASH);
+    }
+
     /// Get the ith character code
     char operator [] (size_t i);
 
@@ -282,6 +618,42 @@ public:
     static String concat(String a, String b);
 };
 
+/**
+Rope, a string built lazily by concatenation. Ropes are string values
+whose heap object holds the two strings concatenated. A rope is turned
+into an interned string when it gets wrapped into a String, which
+happens when its contents are first needed. The flat string is kept
+so that the rope only gets flattened once.
+*/
+class Rope
+{
+public:
+
+    /// Offsets of the length and of the pointers to
+    /// the left, right and flattened strings
+    static const size_t OF_LEN = String::OF_LEN;
+    static const size_t OF_LEFT = HEADER_SIZE + sizeof(Word);
+    static const size_t OF_RIGHT = OF_LEFT + sizeof(refptr);
+    static const size_t OF_FLAT = OF_RIGHT + sizeof(refptr);
+    static const size_t SIZE = OF_FLAT + sizeof(refptr);
+
+    /// Concatenations shorter than this produce flat strings
+    static const size_t MIN_LEN = 64;
+
+    /// Concatenate two string values
+    static Value concat(Value a, Value b);
+
+    /// Get the interned string with the contents of a rope
+    static refptr flatten(refptr rope);
+};
+
+/// Get the length of a string value, without flattening ropes
+inline uint32_t strLength(Value str)
+{
+    assert (str.isString());
+    return *(uint32_t*)((refptr)str + String::OF_LEN);
+}
+
 /**
 Array value wrapper
 Note: arrays have a fixed length set at allocation time
@@ -294,6 +666,9 @@ private:
     /// Note: we want to avoid publicly exposing the array capacity
     size_t getCap();
 
+    /// Move the elements into new storage with a given capacity
+    refptr resize(refptr ptr, uint32_t newCap);
+
 public:
 
     /// Offset and size of the fields
@@ -309,6 +684,9 @@ public:
         return OF_DATA + cap * sizeof(Word) + cap * sizeof(Tag);
     }
 
+    /// Arrays with at least this capacity shrink when mostly empty
+    static const uint32_t MIN_SHRINK_CAP = 64;
+
     /// Allocate a new array of a given length
     Array(size_t minCap);
 
@@ -331,8 +709,106 @@ public:
     Value pop();
 };
 
+class FieldTable;
+
+/**
+Object shape (hidden class). A shape maps the field names of an object
+to the slots its values are stored in. Objects which had the same fields
+added in the same order share the same shape. Shapes form a tree rooted
+at the empty shape, and are never freed. To keep objects used as maps
+with dynamic keys from creating shapes without bound, the number of
+transitions out of a shape and the total number of shapes are limited.
+Objects which would need a new shape beyond these limits switch to
+dictionary mode, where field names are held by the object itself.
+*/
+class Shape
+{
+private:
+
+    /// Shape this one extends with one field, null for the empty shape
+    Shape* parent;
+
+    /// Name of the field stored in the last slot
+    Value name;
+
+    /// Number of fields, the last field is stored at index numFields-1
+    uint32_t numFields;
+
+    /// Shapes extending this one with one more field, by field name
+    std::unordered_map<refptr, Shape*> transitions;
+
+    /// Field name to slot index table, shared along a chain of shapes
+    FieldTable* table = nullptr;
+
+    Shape(Shape* parent, Value name);
+
+    static Shape* emptyShape;
+    static Shape* dictShape;
+
+public:
+
+    /// Shapes with up to this many fields are searched linearly
+    static const size_t MAX_LINEAR_FIELDS = 8;
+
+    /// Maximum number of shapes extending a given shape
+    static const size_t MAX_TRANSITIONS = 64;
+
+    /// Maximum number of shapes with fields
+    static const size_t MAX_SHAPES = 1 << 16;
+
+    /// Slot index returned when a field is not found
+    static const size_t NOT_FOUND = SIZE_MAX;
+
+    /// Get the shape of objects without fields
+    static Shape* empty() { return emptyShape; }
+
+    /// Get the shape shared by all objects in dictionary mode
+    static Shape* dict() { return dictShape; }
+
+    size_t getNumFields() const { return numFields; }
+
+    /// Find the slot index at which a field is stored
+    size_t getSlotIdx(String fieldName);
+
+    /// Get the shape extending this one with a new field. Returns
+    /// null if the field would exceed the limits on new shapes.
+    Shape* addField(String fieldName);
+
+    /// Get the field names, in slot order
+    void getFieldNames(std::vector<Value>& names);
+
+    /// Mark the field names of all shapes, or only of
+    /// the shapes created since the last collection
+    static void markNames(VM& vm, bool youngOnly);
+};
+
+/**
+Inline cache entry for field accesses. The slot index is valid
+for objects of the cached shape when accessing the cached name.
+*/
+struct FieldCache
+{
+    Shape* shape = nullptr;
+    refptr name = nullptr;
+    size_t slotIdx = 0;
+
+    /// Shape of the object after writing the field,
+    /// differs from the cached shape if the field is added
+    Shape* newShape = nullptr;
+};
+
+/// Number of cached field reads which hit and missed their cache
+extern uint64_t fieldCacheHits;
+extern uint64_t fieldCacheMisses;
+
 /**
 Object value wrapper
+Note: field values are stored in slots, the object shape
+maps the field names to their slot index
+
+Objects with many fields switch to dictionary mode. Their slots then
+hold the field names and values, in insertion order, followed by a
+hash table mapping field names to their slot pairs.
 */
 class Object : public Wrapper
 {
@@ -341,18 +817,34 @@ class Object : public Wrapper
     /// Get the object's capacity
     size_t getCap();
 
-    /// Find the slot index at which a field is stored
-    size_t getSlotIdx(
-        refptr ptr,
-        size_t cap,
-        String fieldName,
-        bool newField
-    );
+    /// Get the object's shape
+    Shape* getShape(refptr ptr)
+    {
+        return *(Shape**)(ptr + OF_SHAPE);
+    }
+
+    /// Find the slot index at which a field value is stored
+    size_t findSlot(refptr ptr, Shape* shape, String name);
+
+    /// Allocate a dictionary with a given number of field pairs
+    static refptr newDict(size_t cap);
+
+    /// Add a field to a dictionary with a free field pair
+    static size_t dictAdd(refptr ptr, String name, Value value);
+
+    /// Add a field to a dictionary, growing it if full
+    size_t addDictField(refptr ptr, String name, Value value);
+
+    /// Switch to dictionary mode, adding one more field
+    size_t makeDict(refptr ptr, String name, Value value);
 
 public:
 
     /// Minimum guaranteed object capacity
-    static const size_t MIN_CAP = 16;
+    static const size_t MIN_CAP = 8;
+
+    /// Objects with more fields than this are in dictionary mode
+    static const size_t MAX_SHAPE_FIELDS = 64;
 
     /// Offset and size of the fields
     static const size_t OF_CAP = HEADER_SIZE;
@@ -364,12 +856,16 @@ public:
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t cap)
     {
-        // FIXME: for now, we store tagged values, this will change
-        // once we have proper shapes implemented
-        //return OF_FIELDS + cap * sizeof(Word);
         return OF_FIELDS + cap * sizeof(Value);
     }
 
+    /// Compute the size of a dictionary, with its field
+    /// pairs, its field count and its hash table
+    static constexpr size_t dictMemSize(size_t cap)
+    {
+        return OF_FIELDS + 2 * cap * sizeof(Value) + (1 + 2 * cap) * sizeof(uint32_t);
+    }
+
     /// Allocate a new empty object
     static Object newObject(size_t cap = 0);
 
@@ -379,8 +875,10 @@ public:
     void setField(String name, Value val);
     Value getField(String name);
 
-    /// Property lookup with a slot index cache
-    bool getField(const String& name, Value& value, size_t& idxCache);
+    /// Property accesses with an inline cache
+    bool hasField(String name, FieldCache& cache);
+    void setField(String name, Value value, FieldCache& cache);
+    bool getField(String name, Value& value, FieldCache& cache);
 
     bool hasField(std::string name) { return hasField(String(name)); }
     void setField(std::string name, Value val) { return setField(String(name), val); }
@@ -399,24 +897,21 @@ class ICache
 {
 private:
 
-    // Cached slot index
-    size_t slotIdx = 0;
+    // Cached shape and slot index
+    FieldCache cache;
 
     // Field name to look up
     String fieldName;
 
 public:
 
-    ICache(std::string fieldName)
-    : fieldName(fieldName)
-    {
-    }
+    ICache(std::string fieldName);
 
     Value getField(Object obj)
     {
         Value val;
 
-        if (!obj.getField(fieldName, val, slotIdx))
+        if (!obj.getField(fieldName, val, cache))
         {
             throw RunError("missing field \"" + (std::string)fieldName + "\"");
         }
@@ -460,7 +955,8 @@ class ObjFieldItr
 {
 private:
 
-    Object obj;
+    /// Field names, in slot order
+    std::vector<Value> names;
 
     size_t slotIdx = 0;
 
@@ -496,30 +992,109 @@ public:
 
 int64_t murmurHash2(const void* key, size_t len, uint64_t seed);
 
+/**
+Pool of interned strings. Strings are looked up by contents in an open
+addressing hash table of heap strings, using the hash code stored in
+their header. The pool does not keep strings alive: strings which are
+not reachable are removed from it by the garbage collector.
+*/
 class StringPool
 {
 private:
-    class StringHasher
-    {
-    public:
-        size_t operator()(const std::string str) const
-        {
-            auto len = str.length();
-            auto ptr = str.c_str();
-            return (size_t)murmurHash2(ptr, len, 1337);
-        }
-    };
-    std::unordered_map<std::string, Value, StringHasher> pool;
-    Value newString(std::string str);
+
+    /// Hash table of strings, null for empty slots
+    std::vector<refptr> slots;
+    size_t numStrings = 0;
+
+    /// Strings created since the last collection
+    std::vector<refptr> youngStrings;
+
+    /// Strings held by native code, which are never collected
+    std::vector<Value> pinned;
+
+    /// Buffer used to build strings before they are interned
+    std::string buffer;
+
+    Value newString(const char* data, size_t len, uint32_t hash);
+    void insert(refptr str);
+    void remove(refptr str);
 
 public:
+
+    /// Initial number of hash table slots
+    static const size_t INIT_SLOTS = 1 << 12;
+
     StringPool();
-    Value getString(std::string str);
+
+    Value getString(const char* data, size_t len);
+    Value getString(const std::string& str) { return getString(str.data(), str.size()); }
+
+    /// Get the interned concatenation of two strings
+    Value concat(String a, String b);
+
+    /// Keep a string alive for the lifetime of the VM
+    void pin(Value str);
+
+    /// Mark the pinned strings as garbage collection roots
+    void markPinned(VM& vm);
+
+    /// Remove the strings which were not marked from the pool,
+    /// either all of them, or only the ones created since the
+    /// last collection
+    void sweep(bool youngOnly);
+
+    /// Get the number of interned strings
+    size_t size() const { return numStrings; }
 };
 
+extern StringPool stringPool;
+
 /// Global virtual machine instance
 extern VM vm;
 
+/// Allocate a new array of a given length
+/// Note: defined here so that allocations can be inlined
+inline Array::Array(size_t minCap)
+{
+    // Compute the object size
+    auto numBytes = memSize(minCap);
+
+    // Allocate memory
+    val = vm.alloc(numBytes, TAG_ARRAY);
+    auto ptr = (refptr)val;
+
+    // Set the array capacity and length
+    *(uint32_t*)(ptr + OF_CAP) = minCap;
+    *(uint32_t*)(ptr + OF_LEN) = 0;
+
+    // No initialization necessary because vm.alloc
+    // provides zeroed out memory, initialized to all zeroes,
+    // which evaluates to $undef.
+}
+
+/// Allocate a new empty object
+/// Note: defined here so that allocations can be inlined
+inline Object Object::newObject(size_t cap)
+{
+    if (cap < MIN_CAP)
+        cap = MIN_CAP;
+
+    // Compute the object size
+    auto numBytes = memSize(cap);
+
+    // Allocate memory
+    auto val = vm.alloc(numBytes, TAG_OBJECT);
+    auto ptr = (refptr)val;
+
+    // Set the object capacity
+    *(uint32_t*)(ptr + OF_CAP) = cap;
+
+    // Objects start out without fields
+    *(Shape**)(ptr + OF_SHAPE) = Shape::empty();
+
+    return val;
+}
+
 /// Check if a string is a valid identifier
 bool isValidIdent(std::string identStr);
 
@@ -529,8 +1104,17 @@ Tag strToTag(std::string str);
 /// Get the string representation for a type tag
 std::string tagToStr(Tag tag);
 
+/// Get the name of a tag found in heap object headers
+std::string heapTagToStr(Tag tag);
+
 /// Get a string representation of a source position object
 std::string posToString(Value srcPos);
 
+/// Find all objects and arrays reachable from a set of root values
+void findReachable(
+    const std::vector<Value>& roots,
+    std::unordered_set<refptr>& reachable
+);
+
 /// Unit test for the runtime
 void testRuntime();